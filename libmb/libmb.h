@@ -27,5 +27,89 @@
 void *xmalloc(size_t size);
 void *xrealloc(void *ptr, size_t size);
 FILE *xfopen(char *path, char *mode);
+void *xzalloc(size_t size);
+
+// Buffered block I/O on raw file descriptors, used by the text programs
+// instead of stdio getc/putchar. Buffers are page aligned and MB_BUFSIZ big.
+#define MB_BUFSIZ (128 * 1024)
+#define MB_ALIGN 4096
+
+typedef struct {
+  int fd;
+  char *buf;
+  size_t size;  // Allocated size, grows only for lines longer than MB_BUFSIZ
+  size_t start; // First byte not handed out yet
+  size_t end;   // End of the data read so far
+  size_t scan;  // Where next_line stopped looking for a newline
+  int eof;
+  int error; // errno of the failed read, 0 if none
+} mb_reader;
+
+// Flush policies of mb_writer
+#define MB_FLUSH_FULL 0 // Only when the buffer is full or on mb_flush()
+#define MB_FLUSH_LINE 1 // Also after every write containing a newline
+
+typedef struct {
+  int fd;
+  char *buf;
+  size_t len;
+  int policy;
+  int error;
+} mb_writer;
+
+void mb_reader_init(mb_reader *r, int fd);
+void mb_reader_reset(mb_reader *r, int fd);
+void mb_reader_free(mb_reader *r);
+ssize_t mb_fill(mb_reader *r);
+char *mb_next_block(mb_reader *r, size_t *len);
+char *mb_next_line(mb_reader *r, size_t *len);
+char *mb_next_lines(mb_reader *r, size_t *len);
+
+void mb_writer_init(mb_writer *w, int fd);
+int mb_write(mb_writer *w, const void *data, size_t len);
+int mb_flush(mb_writer *w);
+int mb_writer_free(mb_writer *w);
+
+// Vector instructions usable by the block kernels, see mb_simd_level()
+#define MB_SIMD_NONE 0
+#define MB_SIMD_SSE2 1
+#define MB_SIMD_AVX2 2 // AVX2 and POPCNT
+
+int mb_simd_level(void);
+
+// POSIX extended regular expressions matched a line at a time, see
+// mb_regex.c
+typedef struct mb_regex mb_regex;
+
+#define MB_REGEX_ICASE 1 // Ignore the case of ASCII letters
+
+mb_regex *mb_regex_compile(const char *pattern, size_t len, int flags,
+                           const char **error);
+const char *mb_regex_search(mb_regex *re, const char *s, const char *end);
+const char *mb_regex_must(const mb_regex *re, size_t *len);
+void mb_regex_free(mb_regex *re);
+
+// Byte output without a function call per byte
+static inline int mb_putc(mb_writer *w, int c) {
+  if (w->len == MB_BUFSIZ && mb_flush(w) < 0)
+    return -1;
+  w->buf[w->len++] = c;
+  if (c == '\n' && w->policy == MB_FLUSH_LINE)
+    return mb_flush(w);
+  return 0;
+}
+
+// Live progress of a copy on stderr, see mb_progress.c. Copies done by the
+// kernel go in steps of MB_PROGRESS_CHUNK while it is shown.
+#define MB_PROGRESS_CHUNK (8 * 1024 * 1024)
+void mb_progress_start(uint64_t expected);
+void mb_progress_add(uint64_t bytes);
+void mb_progress_file(void);
+void mb_progress_stop(void);
+
+// ASCII lower case, like tolower() in the C locale but without the call
+static inline int mb_lower(int c) {
+  return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
 
 // These are functions subsidised by the libmb itself
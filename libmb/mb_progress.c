@@ -0,0 +1,141 @@
+/* MiniBox is a busybox/toybox like replacement aiming to be lightweight,
+ * portable, and memory efficient.
+ *
+ * Copyright (C) 2024 Robert Johnson et al <mitnew842@gmail.com>.
+ * All Rights Reserved.
+ *
+ * Licensed under Unlicense License, see file LICENSE in this source tree.
+ *
+ * When adding programs or features, please consider if they can be
+ * accomplished in a sane way with standard unix tools. If they're
+ * programs or features you added, please make sure they are read-
+ * able and understandable by a novice-advanced programmer, if not,
+ * add comments or let me know. Use common sense and please don't
+ * bloat sources.
+ *
+ * I haven't tested but it could compile on windows systems with MSYS/MinGW or
+ * Cygwin. MiniBox should be fairly portable for POSIX systems.
+ *
+ * Licensed under Unlicense License, see file LICENSE in this source tree.
+ */
+#include "libmb.h"
+
+#include <pthread.h>
+#include <time.h>
+
+// Progress of a long copy on stderr. The copy loops only add to counters,
+// a thread of its own wakes up every MB_PROGRESS_INTERVAL_MS, reads them
+// and prints. Nothing is done per chunk but an atomic add, no clock reads
+// and no writes.
+
+#define MB_PROGRESS_INTERVAL_MS 500
+
+static uint64_t done;        // Bytes, atomic
+static uint64_t total;       // 0 when unknown
+static unsigned long files;  // Atomic
+static int running, stopping, on_tty;
+static struct timespec started;
+static pthread_t thread;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+
+static double seconds_since(const struct timespec *t) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (now.tv_sec - t->tv_sec) + (now.tv_nsec - t->tv_nsec) / 1e9;
+}
+
+// 1023 B, 12.5 MiB, ...
+static char *format_size(char *buf, size_t size, double n) {
+  static const char units[][4] = {"B", "KiB", "MiB", "GiB", "TiB", "PiB"};
+  int u = 0;
+
+  while (n >= 1024 && u < 5) {
+    n /= 1024;
+    u++;
+  }
+  snprintf(buf, size, u ? "%.1f %s" : "%.0f %s", n, units[u]);
+  return buf;
+}
+
+static void report(int last) {
+  uint64_t d = __atomic_load_n(&done, __ATOMIC_RELAXED);
+  uint64_t t = total;
+  unsigned long f = __atomic_load_n(&files, __ATOMIC_RELAXED);
+  double secs = seconds_since(&started), rate = secs > 0 ? d / secs : 0;
+  char line[160], a[16], b[16], c[16];
+  int n;
+
+  n = snprintf(line, sizeof(line), "%s", format_size(a, sizeof(a), d));
+  if (t)
+    n += snprintf(line + n, sizeof(line) - n, " / %s (%d%%)",
+                  format_size(b, sizeof(b), t), (int)(d * 100 / t));
+  if (f)
+    n += snprintf(line + n, sizeof(line) - n, ", %lu files", f);
+  n += snprintf(line + n, sizeof(line) - n, ", %s/s",
+                format_size(c, sizeof(c), rate));
+  if (last) {
+    n += snprintf(line + n, sizeof(line) - n, " in %.1fs", secs);
+  } else if (t && rate > 0 && d < t) {
+    long eta = (t - d) / rate + 1;
+
+    n += snprintf(line + n, sizeof(line) - n, ", ETA %ld:%02ld:%02ld",
+                  eta / 3600, eta / 60 % 60, eta % 60);
+  }
+  // A terminal gets one line rewritten in place, anything else a line each
+  if (on_tty)
+    fprintf(stderr, "\r%s\033[K%s", line, last ? "\n" : "");
+  else
+    fprintf(stderr, "%s\n", line);
+}
+
+static void *progress_thread(void *unused) {
+  struct timespec until;
+
+  (void)unused;
+
+  pthread_mutex_lock(&lock);
+  clock_gettime(CLOCK_REALTIME, &until);
+  while (!stopping) {
+    until.tv_nsec += MB_PROGRESS_INTERVAL_MS * 1000000L;
+    until.tv_sec += until.tv_nsec / 1000000000L;
+    until.tv_nsec %= 1000000000L;
+    while (!stopping && pthread_cond_timedwait(&wake, &lock, &until) == 0)
+      ;
+    if (!stopping)
+      report(0);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+// Start reporting, expected is the number of bytes to copy or 0 if it isn't
+// known, then there is no percentage and no ETA
+void mb_progress_start(uint64_t expected) {
+  total = expected;
+  on_tty = isatty(STDERR_FILENO);
+  clock_gettime(CLOCK_MONOTONIC, &started);
+  running = pthread_create(&thread, NULL, progress_thread, NULL) == 0;
+}
+
+void mb_progress_add(uint64_t bytes) {
+  __atomic_fetch_add(&done, bytes, __ATOMIC_RELAXED);
+}
+
+void mb_progress_file(void) {
+  __atomic_fetch_add(&files, 1, __ATOMIC_RELAXED);
+}
+
+// Stop the thread and print the totals with the average rate
+void mb_progress_stop(void) {
+  if (!running)
+    return;
+  pthread_mutex_lock(&lock);
+  stopping = 1;
+  pthread_cond_signal(&wake);
+  pthread_mutex_unlock(&lock);
+  pthread_join(thread, NULL);
+  running = 0;
+  report(1);
+}
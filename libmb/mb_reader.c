@@ -0,0 +1,161 @@
+/* MiniBox is a busybox/toybox like replacement aiming to be lightweight,
+ * portable, and memory efficient.
+ *
+ * Copyright (C) 2024 Robert Johnson et al <mitnew842@gmail.com>.
+ * All Rights Reserved.
+ *
+ * Licensed under Unlicense License, see file LICENSE in this source tree.
+ *
+ * When adding programs or features, please consider if they can be
+ * accomplished in a sane way with standard unix tools. If they're
+ * programs or features you added, please make sure they are read-
+ * able and understandable by a novice-advanced programmer, if not,
+ * add comments or let me know. Use common sense and please don't
+ * bloat sources.
+ *
+ * I haven't tested but it could compile on windows systems with MSYS/MinGW or
+ * Cygwin. MiniBox should be fairly portable for POSIX systems.
+ *
+ * Licensed under Unlicense License, see file LICENSE in this source tree.
+ */
+#include "libmb.h"
+
+static char *xalloc_aligned(size_t size) {
+  void *ptr;
+
+  if (posix_memalign(&ptr, MB_ALIGN, size) != 0)
+    abort();
+  return ptr;
+}
+
+void mb_reader_init(mb_reader *r, int fd) {
+  memset(r, 0, sizeof(*r));
+  r->fd = fd;
+  r->size = MB_BUFSIZ;
+  r->buf = xalloc_aligned(r->size);
+}
+
+// Start reading another file, keeping the buffer. Saves allocating one per
+// file when many small files are read one after the other.
+void mb_reader_reset(mb_reader *r, int fd) {
+  r->fd = fd;
+  r->start = r->end = r->scan = 0;
+  r->eof = r->error = 0;
+}
+
+// The file descriptor is left open, it belongs to the caller
+void mb_reader_free(mb_reader *r) {
+  free(r->buf);
+  r->buf = NULL;
+}
+
+// Read more data after r->end, returns the bytes read, 0 at EOF, -1 on error
+ssize_t mb_fill(mb_reader *r) {
+  ssize_t n;
+
+  if (r->eof)
+    return 0;
+  do {
+    n = read(r->fd, r->buf + r->end, r->size - r->end);
+  } while (n < 0 && errno == EINTR);
+
+  if (n <= 0) {
+    r->eof = 1;
+    if (n < 0)
+      r->error = errno;
+    return n;
+  }
+  r->end += n;
+  return n;
+}
+
+// Hand out everything buffered (reading if nothing is), NULL at EOF. The
+// data stays valid and writable until the next call on the reader.
+char *mb_next_block(mb_reader *r, size_t *len) {
+  char *p;
+
+  if (r->start == r->end) {
+    r->start = r->end = r->scan = 0;
+    if (mb_fill(r) <= 0)
+      return NULL;
+  }
+  p = r->buf + r->start;
+  *len = r->end - r->start;
+  r->start = r->scan = r->end;
+  return p;
+}
+
+// Make room for a refill: move the data not handed out yet to the front or
+// grow the buffer if it already fills it
+static void make_room(mb_reader *r) {
+  if (r->start > 0) {
+    memmove(r->buf, r->buf + r->start, r->end - r->start);
+    r->end -= r->start;
+    r->scan -= r->start;
+    r->start = 0;
+  } else if (r->end == r->size) {
+    char *buf = xalloc_aligned(r->size * 2);
+    memcpy(buf, r->buf, r->end);
+    free(r->buf);
+    r->buf = buf;
+    r->size *= 2;
+  }
+}
+
+// Return the next line including its newline (the last line of the input may
+// have none) as a slice of the buffer, NULL at EOF. Lines are never copied
+// except when the buffer has to be compacted to make room for a refill.
+char *mb_next_line(mb_reader *r, size_t *len) {
+  for (;;) {
+    char *p = r->buf + r->start;
+    char *nl = memchr(r->buf + r->scan, '\n', r->end - r->scan);
+
+    if (nl) {
+      *len = nl - p + 1;
+      r->start = r->scan = r->start + *len;
+      return p;
+    }
+    r->scan = r->end;
+
+    if (r->eof) {
+      if (r->start == r->end)
+        return NULL;
+      *len = r->end - r->start;
+      r->start = r->scan = r->end;
+      return p;
+    }
+
+    make_room(r);
+    mb_fill(r);
+  }
+}
+
+// Like mb_next_block but the slice always ends with a complete line (or the
+// end of the input), so it can be searched as a whole without a line being
+// cut in two
+char *mb_next_lines(mb_reader *r, size_t *len) {
+  for (;;) {
+    char *p = r->buf + r->start;
+    char *nl = r->buf + r->end;
+
+    while (nl > r->buf + r->scan && nl[-1] != '\n')
+      nl--;
+    if (nl > r->buf + r->scan) {
+      *len = nl - p;
+      r->start = r->scan = nl - r->buf;
+      return p;
+    }
+    r->scan = r->end;
+
+    if (r->eof) {
+      if (r->start == r->end)
+        return NULL;
+      *len = r->end - r->start;
+      r->start = r->scan = r->end;
+      return p;
+    }
+
+    make_room(r);
+    mb_fill(r);
+  }
+}
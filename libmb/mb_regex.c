@@ -0,0 +1,1057 @@
+/* MiniBox is a busybox/toybox like replacement aiming to be lightweight,
+ * portable, and memory efficient.
+ *
+ * Copyright (C) 2024 Robert Johnson et al <mitnew842@gmail.com>.
+ * All Rights Reserved.
+ *
+ * Licensed under Unlicense License, see file LICENSE in this source tree.
+ *
+ * When adding programs or features, please consider if they can be
+ * accomplished in a sane way with standard unix tools. If they're
+ * programs or features you added, please make sure they are read-
+ * able and understandable by a novice-advanced programmer, if not,
+ * add comments or let me know. Use common sense and please don't
+ * bloat sources.
+ *
+ * I haven't tested but it could compile on windows systems with MSYS/MinGW or
+ * Cygwin. MiniBox should be fairly portable for POSIX systems.
+ *
+ * Licensed under Unlicense License, see file LICENSE in this source tree.
+ */
+#include "libmb.h"
+#include <ctype.h>
+#include <stddef.h>
+
+// POSIX extended regular expressions for the line oriented programs. The
+// pattern is parsed to a tree, compiled to a Thompson NFA and matched with a
+// DFA built lazily from it, one state per set of NFA states actually seen.
+// The DFA states live in a cache of bounded size which is flushed when full,
+// and if it has to be flushed too often the search goes on by simulating the
+// NFA directly. Either way the time is linear in the input, there is no
+// backtracking. Matching is on bytes, like the C locale. Ignoring the case
+// only adds the other case of the letters to the sets, it costs nothing
+// while searching.
+
+#define RE_MAX_INSTS 65536           // Program size, counted repeats grow it
+#define RE_MAX_DEPTH 1000            // Nesting of groups and repeats
+#define RE_DUP_MAX 255               // Largest count in {m,n}
+#define RE_MUST_MAX 64               // Longest required literal kept
+#define RE_DFA_BYTES (1024 * 1024)   // Budget of the transition table
+#define RE_MATCH 0x80000000u         // Flags a transition to an accepting state
+
+// Parse tree, children and siblings are node indexes, 0 is none
+enum { N_EMPTY, N_SET, N_BOL, N_EOL, N_CAT, N_ALT, N_REPEAT };
+
+typedef struct {
+  unsigned char type;
+  uint32_t child, next;
+  uint32_t set;  // N_SET
+  int min, max;  // N_REPEAT, max is -1 for no limit
+  int depth;
+} re_node;
+
+// NFA program, the start is instruction 0 and the end the one OP_MATCH
+enum { OP_SET, OP_SPLIT, OP_JMP, OP_BOL, OP_EOL, OP_MATCH };
+
+typedef struct {
+  unsigned char op;
+  uint32_t x, y;  // Set index for OP_SET, targets for OP_SPLIT and OP_JMP
+} re_inst;
+
+typedef struct {
+  uint32_t bits[8];
+} re_set;
+
+// Sparse set of instructions, clearing it is just n = 0
+typedef struct {
+  uint32_t *dense, *sparse, n;
+} re_sset;
+
+// A DFA state is the sorted list of the NFA instructions it stands for that
+// matter: the ones consuming a byte, pending $ and the match
+#define ST_ACCEPT 1     // The match is in the list
+#define ST_EOL_ACCEPT 2 // The match is reached when the line ends here
+#define ST_LINE_START 4 // The state for the start of a line, ^ holds
+
+typedef struct {
+  uint32_t off, n, hash, flags;
+} re_state;
+
+struct mb_regex {
+  re_inst *prog;
+  uint32_t ninst;
+  re_set *sets;
+  unsigned char cls[256];  // Byte classes: bytes no set tells apart share one
+  uint32_t nclasses;
+  unsigned char must[RE_MUST_MAX];
+  size_t must_len;
+
+  re_sset ss[4]; // Two for stepping, one for $ at the line end, one spare
+  uint32_t *stack, *key;
+
+  // DFA cache, state 0 is unused so 0 in trans[] means not built yet
+  uint32_t *trans;  // nclasses per state, holding row offsets and RE_MATCH
+  re_state *states;
+  uint32_t nstates, max_states;
+  uint32_t *pool;   // Instruction lists of the states
+  size_t npool, max_pool;
+  uint32_t *table;  // Hash table of state numbers
+  uint32_t table_mask;
+  uint32_t start;
+  size_t progress;  // Bytes searched since the last flush
+  int use_nfa;
+};
+
+typedef struct {
+  const unsigned char *p, *end;
+  re_node *nodes;
+  uint32_t nnodes, node_cap;
+  re_set *sets;
+  uint32_t nsets, set_cap;
+  uint32_t single[256]; // Set index + 1 of each one byte set
+  re_inst *prog;
+  uint32_t ninst, inst_cap;
+  int group_depth;
+  int icase;
+  const char *error;
+} re_parser;
+
+static uint32_t new_node(re_parser *ps, int type) {
+  if (ps->nnodes == ps->node_cap) {
+    ps->node_cap = ps->node_cap ? ps->node_cap * 2 : 64;
+    ps->nodes = xrealloc(ps->nodes, ps->node_cap * sizeof(*ps->nodes));
+  }
+  memset(&ps->nodes[ps->nnodes], 0, sizeof(*ps->nodes));
+  ps->nodes[ps->nnodes].type = type;
+  ps->nodes[ps->nnodes].depth = 1;
+  return ps->nnodes++;
+}
+
+static uint32_t new_set(re_parser *ps, const re_set *set) {
+  if (ps->nsets == ps->set_cap) {
+    ps->set_cap = ps->set_cap ? ps->set_cap * 2 : 64;
+    ps->sets = xrealloc(ps->sets, ps->set_cap * sizeof(*ps->sets));
+  }
+  ps->sets[ps->nsets] = *set;
+  return ps->nsets++;
+}
+
+static void set_add(re_set *set, unsigned char c) {
+  set->bits[c >> 5] |= 1u << (c & 31);
+}
+
+static int set_has(const re_set *set, unsigned char c) {
+  return set->bits[c >> 5] >> (c & 31) & 1;
+}
+
+// Put both cases of the letters in, the sets built for \w, \s and . have
+// them already
+static void set_fold(re_set *set) {
+  for (int c = 'a'; c <= 'z'; c++) {
+    if (set_has(set, c) || set_has(set, toupper(c))) {
+      set_add(set, c);
+      set_add(set, toupper(c));
+    }
+  }
+}
+
+static uint32_t set_node(re_parser *ps, const re_set *set) {
+  uint32_t n = new_node(ps, N_SET);
+
+  ps->nodes[n].set = new_set(ps, set);
+  return n;
+}
+
+static uint32_t byte_node(re_parser *ps, unsigned char c) {
+  uint32_t n = new_node(ps, N_SET);
+
+  if (ps->single[c] == 0) {
+    re_set set = {{0}};
+
+    set_add(&set, c);
+    if (ps->icase)
+      set_fold(&set);
+    ps->single[c] = new_set(ps, &set) + 1;
+  }
+  ps->nodes[n].set = ps->single[c] - 1;
+  return n;
+}
+
+static const struct {
+  const char *name;
+  int (*fn)(int);
+} char_classes[] = {
+    {"alpha", isalpha}, {"digit", isdigit}, {"alnum", isalnum},
+    {"upper", isupper}, {"lower", islower}, {"space", isspace},
+    {"blank", isblank}, {"punct", ispunct}, {"print", isprint},
+    {"graph", isgraph}, {"cntrl", iscntrl}, {"xdigit", isxdigit},
+};
+
+static int add_class(re_set *set, const unsigned char *name, size_t len) {
+  for (size_t i = 0; i < sizeof(char_classes) / sizeof(char_classes[0]); i++) {
+    if (strlen(char_classes[i].name) == len &&
+        memcmp(char_classes[i].name, name, len) == 0) {
+      for (int c = 0; c < 256; c++) {
+        if (char_classes[i].fn(c))
+          set_add(set, c);
+      }
+      return 0;
+    }
+  }
+  return -1;
+}
+
+// One element of a bracket expression that stands for a single byte: a
+// plain byte, [.c.] or [=c=]. Returns -1 on errors.
+static int bracket_byte(re_parser *ps) {
+  const unsigned char *p = ps->p;
+
+  if (p + 1 < ps->end && p[0] == '[' && (p[1] == '.' || p[1] == '=')) {
+    if (p + 4 >= ps->end || p[3] != p[1] || p[4] != ']') {
+      ps->error = "Invalid collation character";
+      return -1;
+    }
+    ps->p += 5;
+    return p[2];
+  }
+  ps->p++;
+  return p[0];
+}
+
+static uint32_t parse_bracket(re_parser *ps) {
+  re_set set = {{0}};
+  int negate = 0, first = 1;
+
+  ps->p++;
+  if (ps->p < ps->end && *ps->p == '^') {
+    negate = 1;
+    ps->p++;
+  }
+  for (;;) {
+    int lo, hi;
+
+    if (ps->p >= ps->end) {
+      ps->error = "Unmatched [, [^, [:, [., or [=";
+      return 0;
+    }
+    if (*ps->p == ']' && !first) {
+      ps->p++;
+      break;
+    }
+    first = 0;
+
+    if (ps->p + 1 < ps->end && ps->p[0] == '[' && ps->p[1] == ':') {
+      const unsigned char *name = ps->p + 2, *q = name;
+
+      while (q + 1 < ps->end && !(q[0] == ':' && q[1] == ']'))
+        q++;
+      if (q + 1 >= ps->end || add_class(&set, name, q - name) < 0) {
+        ps->error = "Invalid character class name";
+        return 0;
+      }
+      ps->p = q + 2;
+      continue;
+    }
+
+    if ((lo = bracket_byte(ps)) < 0)
+      return 0;
+    hi = lo;
+    if (ps->p + 1 < ps->end && ps->p[0] == '-' && ps->p[1] != ']') {
+      ps->p++;
+      if ((hi = bracket_byte(ps)) < 0)
+        return 0;
+      if (hi < lo) {
+        ps->error = "Invalid range end";
+        return 0;
+      }
+    }
+    for (int c = lo; c <= hi; c++)
+      set_add(&set, c);
+  }
+
+  // [^a] ignoring the case has neither a nor A
+  if (ps->icase)
+    set_fold(&set);
+  if (negate) {
+    for (int i = 0; i < 8; i++)
+      set.bits[i] = ~set.bits[i];
+  }
+  // Lines never contain the newline
+  set.bits['\n' >> 5] &= ~(1u << ('\n' & 31));
+  return set_node(ps, &set);
+}
+
+// \w \W \s \S like GNU, any other escaped byte stands for itself except
+// the word boundaries and back-references. A DFA can't do those, so they
+// are an error instead of silently matching the byte.
+static uint32_t parse_escape(re_parser *ps) {
+  re_set set = {{0}};
+  int c, negate;
+
+  if (ps->p + 1 >= ps->end) {
+    ps->error = "Trailing backslash";
+    return 0;
+  }
+  c = ps->p[1];
+  ps->p += 2;
+  if ((c && strchr("bB<>`'", c)) || (c >= '1' && c <= '9')) {
+    ps->error = c >= '1' && c <= '9' ? "Back-references are not supported"
+                                     : "Word and buffer anchors (\\b \\B "
+                                       "\\< \\> \\` \\') are not supported";
+    return 0;
+  }
+  if (c != 'w' && c != 'W' && c != 's' && c != 'S')
+    return byte_node(ps, c);
+
+  negate = c == 'W' || c == 'S';
+  for (int b = 0; b < 256; b++) {
+    int in = c == 'w' || c == 'W' ? isalnum(b) || b == '_' : isspace(b);
+    if (in != negate && b != '\n')
+      set_add(&set, b);
+  }
+  return set_node(ps, &set);
+}
+
+static uint32_t parse_alt(re_parser *ps);
+
+static uint32_t parse_atom(re_parser *ps) {
+  re_set set;
+  uint32_t n;
+
+  switch (*ps->p) {
+  case '(':
+    if (++ps->group_depth > RE_MAX_DEPTH) {
+      ps->error = "Regular expression too big";
+      return 0;
+    }
+    ps->p++;
+    n = parse_alt(ps);
+    if (ps->error)
+      return 0;
+    if (ps->p >= ps->end || *ps->p != ')') {
+      ps->error = "Unmatched ( or \\(";
+      return 0;
+    }
+    ps->p++;
+    ps->group_depth--;
+    return n;
+  case '[':
+    return parse_bracket(ps);
+  case '\\':
+    return parse_escape(ps);
+  case '.':
+    ps->p++;
+    memset(&set, 0xff, sizeof(set));
+    set.bits['\n' >> 5] &= ~(1u << ('\n' & 31));
+    return set_node(ps, &set);
+  case '^':
+    ps->p++;
+    return new_node(ps, N_BOL);
+  case '$':
+    ps->p++;
+    return new_node(ps, N_EOL);
+  default:
+    // Also a { that doesn't start an interval and a ) without a (
+    return byte_node(ps, *ps->p++);
+  }
+}
+
+// Read a {m}, {m,} or {m,n} interval. Returns 0 if there is none, the brace
+// is then taken literally, and -1 if it is malformed.
+static int parse_interval(re_parser *ps, int *min, int *max) {
+  const unsigned char *p = ps->p + 1;
+  int m = 0, n;
+
+  if (p >= ps->end || !isdigit(*p))
+    return 0;
+  // Every digit is read, a count past the limit stays above it
+  for (; p < ps->end && isdigit(*p); p++)
+    if (m <= RE_DUP_MAX)
+      m = m * 10 + (*p - '0');
+  n = m;
+  if (p < ps->end && *p == ',') {
+    p++;
+    n = -1;
+    if (p < ps->end && isdigit(*p)) {
+      n = 0;
+      for (; p < ps->end && isdigit(*p); p++)
+        if (n <= RE_DUP_MAX)
+          n = n * 10 + (*p - '0');
+    }
+  }
+  if (p >= ps->end || *p != '}')
+    return 0;
+  if (m > RE_DUP_MAX || n > RE_DUP_MAX || (n >= 0 && n < m)) {
+    ps->error = "Invalid content of \\{\\}";
+    return -1;
+  }
+  ps->p = p + 1;
+  *min = m;
+  *max = n;
+  return 1;
+}
+
+static uint32_t parse_cat(re_parser *ps) {
+  uint32_t cat = new_node(ps, N_CAT), last = 0;
+
+  while (ps->p < ps->end && *ps->p != '|' && *ps->p != '\n' &&
+         !(*ps->p == ')' && ps->group_depth > 0)) {
+    uint32_t atom;
+
+    // Like GNU a repeat with nothing before it repeats the empty string
+    if (*ps->p == '*' || *ps->p == '+' || *ps->p == '?')
+      atom = new_node(ps, N_EMPTY);
+    else
+      atom = parse_atom(ps);
+    if (ps->error)
+      return 0;
+    while (ps->p < ps->end) {
+      int min, max, found;
+      uint32_t rep;
+
+      if (*ps->p == '*' || *ps->p == '+' || *ps->p == '?') {
+        min = *ps->p == '+';
+        max = *ps->p == '?' ? 1 : -1;
+        ps->p++;
+      } else if (*ps->p == '{') {
+        if ((found = parse_interval(ps, &min, &max)) < 0)
+          return 0;
+        if (found == 0)
+          break;
+      } else {
+        break;
+      }
+      rep = new_node(ps, N_REPEAT);
+      ps->nodes[rep].child = atom;
+      ps->nodes[rep].min = min;
+      ps->nodes[rep].max = max;
+      ps->nodes[rep].depth = ps->nodes[atom].depth + 1;
+      atom = rep;
+    }
+    if (ps->nodes[atom].depth > RE_MAX_DEPTH) {
+      ps->error = "Regular expression too big";
+      return 0;
+    }
+
+    if (last)
+      ps->nodes[last].next = atom;
+    else
+      ps->nodes[cat].child = atom;
+    if (ps->nodes[atom].depth >= ps->nodes[cat].depth)
+      ps->nodes[cat].depth = ps->nodes[atom].depth + 1;
+    last = atom;
+  }
+  return cat;
+}
+
+// Alternatives are separated by | or a newline, like grep's pattern lists
+static uint32_t parse_alt(re_parser *ps) {
+  uint32_t alt = new_node(ps, N_ALT), last;
+
+  // parse_cat() may move ps->nodes, its result is stored once it is back
+  last = parse_cat(ps);
+  ps->nodes[alt].child = last;
+  while (!ps->error && ps->p < ps->end && (*ps->p == '|' || *ps->p == '\n')) {
+    uint32_t branch;
+
+    if (*ps->p == '\n' && ps->group_depth > 0) {
+      ps->error = "Unmatched ( or \\(";
+      break;
+    }
+    ps->p++;
+    branch = parse_cat(ps);
+    ps->nodes[last].next = branch;
+    last = branch;
+  }
+  if (ps->error)
+    return 0;
+  for (uint32_t k = ps->nodes[alt].child; k; k = ps->nodes[k].next) {
+    if (ps->nodes[k].depth >= ps->nodes[alt].depth)
+      ps->nodes[alt].depth = ps->nodes[k].depth + 1;
+  }
+  if (ps->nodes[alt].depth > RE_MAX_DEPTH)
+    ps->error = "Regular expression too big";
+  return alt;
+}
+
+static uint32_t emit(re_parser *ps, int op, uint32_t x, uint32_t y) {
+  if (ps->ninst == RE_MAX_INSTS) {
+    ps->error = "Regular expression too big";
+    return 0;
+  }
+  if (ps->ninst == ps->inst_cap) {
+    ps->inst_cap = ps->inst_cap ? ps->inst_cap * 2 : 64;
+    ps->prog = xrealloc(ps->prog, ps->inst_cap * sizeof(*ps->prog));
+  }
+  ps->prog[ps->ninst].op = op;
+  ps->prog[ps->ninst].x = x;
+  ps->prog[ps->ninst].y = y;
+  return ps->ninst++;
+}
+
+// Jumps waiting for their target are chained through the field they will
+// hold, with ~0u ending the chain
+static void patch(re_parser *ps, uint32_t chain, int use_y, uint32_t to) {
+  while (chain != ~0u && !ps->error) {
+    uint32_t *field = use_y ? &ps->prog[chain].y : &ps->prog[chain].x;
+
+    chain = *field;
+    *field = to;
+  }
+}
+
+static void gen(re_parser *ps, uint32_t n) {
+  const re_node *node = &ps->nodes[n];
+  uint32_t chain = ~0u, k, at;
+
+  if (ps->error)
+    return;
+  switch (node->type) {
+  case N_SET:
+    emit(ps, OP_SET, node->set, 0);
+    break;
+  case N_BOL:
+    emit(ps, OP_BOL, 0, 0);
+    break;
+  case N_EOL:
+    emit(ps, OP_EOL, 0, 0);
+    break;
+  case N_CAT:
+    for (k = node->child; k; k = ps->nodes[k].next)
+      gen(ps, k);
+    break;
+  case N_ALT:
+    // split L1, next; L1: branch; jmp end; next: split L2, next; ...
+    for (k = node->child; ps->nodes[k].next && !ps->error;
+         k = ps->nodes[k].next) {
+      uint32_t split = emit(ps, OP_SPLIT, ps->ninst + 1, 0);
+
+      gen(ps, k);
+      at = emit(ps, OP_JMP, chain, 0);
+      chain = at;
+      if (!ps->error)
+        ps->prog[split].y = ps->ninst;
+    }
+    gen(ps, k);
+    patch(ps, chain, 0, ps->ninst);
+    break;
+  case N_REPEAT:
+    k = node->child;
+    for (int i = 0; i < node->min - (node->max < 0 && node->min > 0); i++)
+      gen(ps, k);
+    if (node->max < 0 && node->min > 0) {
+      // x+: L: x; split L, out
+      at = ps->ninst;
+      gen(ps, k);
+      emit(ps, OP_SPLIT, at, ps->ninst + 1);
+    } else if (node->max < 0) {
+      // x*: L: split L1, out; L1: x; jmp L; out:
+      at = emit(ps, OP_SPLIT, ps->ninst + 1, 0);
+      gen(ps, k);
+      emit(ps, OP_JMP, at, 0);
+      if (!ps->error)
+        ps->prog[at].y = ps->ninst;
+    } else {
+      // Each optional copy can be skipped to the end
+      for (int i = node->min; i < node->max && !ps->error; i++) {
+        at = emit(ps, OP_SPLIT, ps->ninst + 1, chain);
+        chain = at;
+        gen(ps, k);
+      }
+      patch(ps, chain, 1, ps->ninst);
+    }
+    break;
+  }
+}
+
+// Required literal: every match of the node contains in[], starts with
+// left[] and ends with right[]. When exact the node matches that one string
+// only and the three are the same.
+typedef struct {
+  int exact;
+  size_t llen, rlen, ilen;
+  unsigned char left[RE_MUST_MAX], right[RE_MUST_MAX], in[RE_MUST_MAX];
+} re_must;
+
+static void must_keep_longer(unsigned char *dst, size_t *dlen,
+                             const unsigned char *src, size_t len) {
+  if (len > *dlen) {
+    memcpy(dst, src, len);
+    *dlen = len;
+  }
+}
+
+// Join a and b truncated to RE_MUST_MAX, keeping the end of the result
+// instead of its start if keep_end
+static size_t must_join(unsigned char *dst, const unsigned char *a, size_t alen,
+                        const unsigned char *b, size_t blen, int keep_end) {
+  unsigned char tmp[2 * RE_MUST_MAX];
+  size_t len = alen + blen;
+
+  memcpy(tmp, a, alen);
+  memcpy(tmp + alen, b, blen);
+  if (len > RE_MUST_MAX) {
+    if (keep_end)
+      memmove(tmp, tmp + len - RE_MUST_MAX, RE_MUST_MAX);
+    len = RE_MUST_MAX;
+  }
+  memcpy(dst, tmp, len);
+  return len;
+}
+
+static void must_cat(re_must *r, const re_must *b) {
+  re_must a = *r;
+  unsigned char join[RE_MUST_MAX];
+  size_t jlen = must_join(join, a.right, a.rlen, b->left, b->llen, 0);
+
+  must_keep_longer(r->in, &r->ilen, b->in, b->ilen);
+  must_keep_longer(r->in, &r->ilen, join, jlen);
+  if (a.exact)
+    r->llen = must_join(r->left, a.left, a.llen, b->left, b->llen, 0);
+  if (b->exact)
+    r->rlen = must_join(r->right, a.right, a.rlen, b->right, b->rlen, 1);
+  else
+    memcpy(r->right, b->right, r->rlen = b->rlen);
+  r->exact = a.exact && b->exact && a.llen + b->llen <= RE_MUST_MAX;
+  must_keep_longer(r->in, &r->ilen, r->left, r->llen);
+  must_keep_longer(r->in, &r->ilen, r->right, r->rlen);
+}
+
+static void must_alt(re_must *r, const re_must *b) {
+  size_t i = 0, j = 0;
+
+  r->exact = r->exact && b->exact && r->llen == b->llen &&
+             memcmp(r->left, b->left, r->llen) == 0;
+  if (r->exact)
+    return;
+  while (i < r->llen && i < b->llen && r->left[i] == b->left[i])
+    i++;
+  r->llen = i;
+  while (j < r->rlen && j < b->rlen &&
+         r->right[r->rlen - 1 - j] == b->right[b->rlen - 1 - j])
+    j++;
+  memmove(r->right, r->right + r->rlen - j, j);
+  r->rlen = j;
+  if (r->ilen != b->ilen || memcmp(r->in, b->in, r->ilen) != 0) {
+    r->ilen = 0;
+    must_keep_longer(r->in, &r->ilen, r->left, r->llen);
+    must_keep_longer(r->in, &r->ilen, r->right, r->rlen);
+  }
+}
+
+static void must(const re_parser *ps, uint32_t n, re_must *r) {
+  const re_node *node = &ps->nodes[n];
+  const re_set *set;
+  re_must sub;
+  int count = 0, c = -1;
+
+  memset(r, 0, offsetof(re_must, left));
+  switch (node->type) {
+  case N_SET:
+    // Ignoring the case a set of both cases of one letter is that letter,
+    // the required literal is then in lower case
+    set = &ps->sets[node->set];
+    for (int b = 0; b < 256 && count < 2; b++) {
+      int f = ps->icase ? mb_lower(b) : b;
+
+      if (set_has(set, b) && f != c)
+        c = f, count++;
+    }
+    if (count == 1) {
+      r->exact = 1;
+      r->left[0] = r->right[0] = r->in[0] = c;
+      r->llen = r->rlen = r->ilen = 1;
+    }
+    break;
+  case N_EMPTY:
+  case N_BOL:
+  case N_EOL:
+    r->exact = 1;
+    break;
+  case N_CAT:
+    r->exact = 1;
+    for (uint32_t k = node->child; k; k = ps->nodes[k].next) {
+      must(ps, k, &sub);
+      must_cat(r, &sub);
+    }
+    break;
+  case N_ALT:
+    must(ps, node->child, r);
+    for (uint32_t k = ps->nodes[node->child].next; k; k = ps->nodes[k].next) {
+      must(ps, k, &sub);
+      must_alt(r, &sub);
+    }
+    break;
+  case N_REPEAT:
+    if (node->min == 0)
+      break;
+    must(ps, node->child, r);
+    if (node->min != 1 || node->max != 1)
+      r->exact = 0;
+    break;
+  }
+}
+
+// Split the bytes in classes no set in the program tells apart, the newline
+// always gets its own since it ends the lines
+static void byte_classes(mb_regex *re) {
+  re_set nl = {{0}};
+  int n = 1;
+
+  set_add(&nl, '\n');
+  memset(re->cls, 0, sizeof(re->cls));
+  for (uint32_t i = 0; i <= re->ninst; i++) {
+    const re_set *set = &nl;
+    int in[256], out[256], m = 0;
+
+    if (i < re->ninst) {
+      if (re->prog[i].op != OP_SET)
+        continue;
+      set = &re->sets[re->prog[i].x];
+    }
+    for (int k = 0; k < n; k++)
+      in[k] = out[k] = -1;
+    for (int c = 0; c < 256; c++) {
+      int *slot = set_has(set, c) ? &in[re->cls[c]] : &out[re->cls[c]];
+
+      if (*slot < 0)
+        *slot = m++;
+      re->cls[c] = *slot;
+    }
+    n = m;
+  }
+  re->nclasses = n;
+}
+
+static int sset_has(const re_sset *s, uint32_t x) {
+  return s->sparse[x] < s->n && s->dense[s->sparse[x]] == x;
+}
+
+static void sset_add(re_sset *s, uint32_t x) {
+  s->sparse[x] = s->n;
+  s->dense[s->n++] = x;
+}
+
+#define CTX_BOL 1 // At the start of a line, ^ holds
+#define CTX_EOL 2 // At the end of a line, $ holds
+
+// Add pc and everything reachable from it without consuming a byte
+static void closure(mb_regex *re, re_sset *s, uint32_t pc, int ctx) {
+  uint32_t top = 0;
+
+  re->stack[top++] = pc;
+  while (top > 0) {
+    const re_inst *in;
+
+    pc = re->stack[--top];
+    if (sset_has(s, pc))
+      continue;
+    sset_add(s, pc);
+    in = &re->prog[pc];
+    switch (in->op) {
+    case OP_JMP:
+      re->stack[top++] = in->x;
+      break;
+    case OP_SPLIT:
+      re->stack[top++] = in->y;
+      re->stack[top++] = in->x;
+      break;
+    case OP_BOL:
+      if (ctx & CTX_BOL)
+        re->stack[top++] = pc + 1;
+      break;
+    case OP_EOL:
+      if (ctx & CTX_EOL)
+        re->stack[top++] = pc + 1;
+      break;
+    }
+  }
+}
+
+// Move the instructions of s one byte further
+static void step(mb_regex *re, const uint32_t *pcs, uint32_t n, re_sset *to,
+                 unsigned char c) {
+  to->n = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    const re_inst *in = &re->prog[pcs[i]];
+
+    if (in->op == OP_SET && set_has(&re->sets[in->x], c))
+      closure(re, to, pcs[i] + 1, 0);
+  }
+  // The match can also start at the next byte
+  closure(re, to, 0, 0);
+}
+
+// Whether the match is reached if the line ends with the instructions of s
+static int accepts_at_eol(mb_regex *re, const uint32_t *pcs, uint32_t n,
+                          int ctx) {
+  re_sset *eol = &re->ss[2];
+
+  eol->n = 0;
+  for (uint32_t i = 0; i < n; i++) {
+    if (re->prog[pcs[i]].op == OP_EOL)
+      closure(re, eol, pcs[i], ctx | CTX_EOL);
+  }
+  return sset_has(eol, re->ninst - 1);
+}
+
+static int cmp_pc(const void *a, const void *b) {
+  uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+  return x < y ? -1 : x > y;
+}
+
+// Find or add the DFA state for the instructions in s, returns 0 when the
+// cache is full
+static uint32_t dfa_state(mb_regex *re, re_sset *s, int flags) {
+  uint32_t n = 0, hash = 2166136261u ^ flags, slot, id;
+  re_state *st;
+
+  for (uint32_t i = 0; i < s->n; i++) {
+    int op = re->prog[s->dense[i]].op;
+    if (op == OP_SET || op == OP_EOL || op == OP_MATCH)
+      re->key[n++] = s->dense[i];
+  }
+  qsort(re->key, n, sizeof(*re->key), cmp_pc);
+  for (uint32_t i = 0; i < n; i++)
+    hash = (hash ^ re->key[i]) * 16777619u;
+
+  for (slot = hash & re->table_mask; (id = re->table[slot]) != 0;
+       slot = (slot + 1) & re->table_mask) {
+    st = &re->states[id];
+    if (st->hash == hash && st->n == n &&
+        (st->flags & ST_LINE_START) == (uint32_t)(flags & ST_LINE_START) &&
+        memcmp(re->pool + st->off, re->key, n * sizeof(*re->key)) == 0)
+      return id;
+  }
+
+  if (re->nstates == re->max_states || re->npool + n > re->max_pool)
+    return 0;
+  id = re->nstates++;
+  st = &re->states[id];
+  st->off = re->npool;
+  st->n = n;
+  st->hash = hash;
+  st->flags = flags;
+  memcpy(re->pool + re->npool, re->key, n * sizeof(*re->key));
+  re->npool += n;
+  if (n > 0 && re->key[n - 1] == re->ninst - 1)
+    st->flags |= ST_ACCEPT;
+  if (accepts_at_eol(re, re->pool + st->off, n,
+                     flags & ST_LINE_START ? CTX_BOL : 0))
+    st->flags |= ST_EOL_ACCEPT;
+  memset(re->trans + (size_t)id * re->nclasses, 0,
+         re->nclasses * sizeof(*re->trans));
+  re->table[slot] = id;
+  return id;
+}
+
+// Empty the cache, only the start state is added back
+static void dfa_flush(mb_regex *re) {
+  re->nstates = 1;
+  re->npool = 0;
+  re->progress = 0;
+  memset(re->table, 0, (re->table_mask + 1) * sizeof(*re->table));
+  re->ss[3].n = 0;
+  closure(re, &re->ss[3], 0, CTX_BOL);
+  re->start = dfa_state(re, &re->ss[3], ST_LINE_START);
+  if (re->start == 0)
+    re->use_nfa = 1;
+}
+
+// Build the transition of state id on byte c, the value stored in trans[]
+// is returned. Returns 0 if the DFA should be given up because the cache
+// gets flushed with too little progress.
+static uint32_t dfa_step(mb_regex *re, uint32_t id, unsigned char c) {
+  uint32_t next, flag = 0;
+
+  if (c == '\n') {
+    // The line ends: a pending $ may complete the match, then a new line
+    next = re->start;
+    if (re->states[id].flags & ST_EOL_ACCEPT)
+      flag = RE_MATCH;
+  } else {
+    re_state *st = &re->states[id];
+
+    step(re, re->pool + st->off, st->n, &re->ss[0], c);
+    next = dfa_state(re, &re->ss[0], 0);
+    if (next == 0) {
+      // Full: flush and add the current state back, unless the cache
+      // hardly got used since the last flush
+      uint32_t n = st->n, flags = st->flags & ST_LINE_START;
+
+      if (re->progress < 10 * (size_t)re->max_states)
+        return 0;
+      re->ss[1].n = 0;
+      for (uint32_t i = 0; i < n; i++)
+        sset_add(&re->ss[1], re->pool[st->off + i]);
+      dfa_flush(re);
+      if (re->use_nfa || (id = dfa_state(re, &re->ss[1], flags)) == 0 ||
+          (next = dfa_state(re, &re->ss[0], 0)) == 0)
+        return 0;
+    }
+    if (re->states[next].flags & ST_ACCEPT)
+      flag = RE_MATCH;
+  }
+  next = next * re->nclasses | flag;
+  re->trans[(size_t)id * re->nclasses + re->cls[c]] = next;
+  return next;
+}
+
+// Simulate the NFA, the fallback when the DFA cache thrashes
+static const char *nfa_search(mb_regex *re, const char *s, const char *end) {
+  const unsigned char *p = (const unsigned char *)s;
+  const unsigned char *e = (const unsigned char *)end, *line = p;
+  re_sset *cur = &re->ss[0], *next = &re->ss[1], *tmp;
+
+  cur->n = 0;
+  closure(re, cur, 0, CTX_BOL);
+  for (;;) {
+    if (sset_has(cur, re->ninst - 1))
+      return (const char *)line;
+    if (p == e || *p == '\n') {
+      if (accepts_at_eol(re, cur->dense, cur->n, p == line ? CTX_BOL : 0))
+        return (const char *)line;
+      if (p == e || ++p == e)
+        return NULL;
+      line = p;
+      cur->n = 0;
+      closure(re, cur, 0, CTX_BOL);
+      continue;
+    }
+    step(re, cur->dense, cur->n, next, *p++);
+    tmp = cur;
+    cur = next;
+    next = tmp;
+  }
+}
+
+// Find the first line of [s, end) with a match, end must be at a line end.
+// Returns a pointer into that line or NULL.
+const char *mb_regex_search(mb_regex *re, const char *s, const char *end) {
+  const unsigned char *p = (const unsigned char *)s;
+  const unsigned char *e = (const unsigned char *)end, *mark = p;
+  uint32_t state;
+
+  if (s == end)
+    return NULL;
+  if (re->use_nfa)
+    return nfa_search(re, s, end);
+  if (re->states[re->start].flags & ST_ACCEPT)
+    return s; // Matches the empty string, every line matches
+
+  // States are kept as the offset of their row in trans[], a row entry
+  // that is 0 (not built yet) or has RE_MATCH takes the slow path
+  state = re->start * re->nclasses;
+  while (p < e) {
+    uint32_t next = re->trans[state + re->cls[*p]];
+
+    if ((int32_t)next <= 0) {
+      if (next == 0) {
+        re->progress += p - mark;
+        mark = p;
+        next = dfa_step(re, state / re->nclasses, *p);
+      }
+      if (next == 0) {
+        re->use_nfa = 1;
+        while (p > (const unsigned char *)s && p[-1] != '\n')
+          p--;
+        return nfa_search(re, (const char *)p, end);
+      }
+      if (next & RE_MATCH)
+        return (const char *)p;
+    }
+    state = next;
+    p++;
+  }
+  re->progress += p - mark;
+  if (e[-1] != '\n' &&
+      (re->states[state / re->nclasses].flags & ST_EOL_ACCEPT))
+    return end - 1;
+  return NULL;
+}
+
+// A string every match contains, for a quick search before the regex runs.
+// Empty if there is none, in lower case with MB_REGEX_ICASE.
+const char *mb_regex_must(const mb_regex *re, size_t *len) {
+  *len = re->must_len;
+  return (const char *)re->must;
+}
+
+// Compile a POSIX extended regular expression, a newline in it separates
+// alternatives like |. flags can have MB_REGEX_ICASE. Returns NULL with
+// *error set if it is invalid.
+mb_regex *mb_regex_compile(const char *pattern, size_t len, int flags,
+                           const char **error) {
+  re_parser ps;
+  mb_regex *re;
+  re_must *m;
+  uint32_t root, row;
+
+  memset(&ps, 0, sizeof(ps));
+  ps.p = (const unsigned char *)pattern;
+  ps.end = ps.p + len;
+  new_node(&ps, N_EMPTY); // Node 0 stands for none
+  ps.icase = flags & MB_REGEX_ICASE;
+  root = parse_alt(&ps);
+  if (!ps.error) {
+    gen(&ps, root);
+    emit(&ps, OP_MATCH, 0, 0);
+  }
+  if (ps.error) {
+    *error = ps.error;
+    free(ps.nodes);
+    free(ps.sets);
+    free(ps.prog);
+    return NULL;
+  }
+
+  re = xzalloc(sizeof(*re));
+  re->prog = ps.prog;
+  re->ninst = ps.ninst;
+  re->sets = ps.sets;
+  m = xmalloc(sizeof(*m));
+  must(&ps, root, m);
+  memcpy(re->must, m->in, re->must_len = m->ilen);
+  free(m);
+  free(ps.nodes);
+  byte_classes(re);
+
+  for (int i = 0; i < 4; i++) {
+    re->ss[i].dense = xmalloc(re->ninst * sizeof(uint32_t));
+    re->ss[i].sparse = xzalloc(re->ninst * sizeof(uint32_t));
+  }
+  re->stack = xmalloc((2 * re->ninst + 1) * sizeof(*re->stack));
+  re->key = xmalloc(re->ninst * sizeof(*re->key));
+
+  row = re->nclasses * sizeof(*re->trans);
+  re->max_states = RE_DFA_BYTES / (row + sizeof(re_state) + 2 * sizeof(uint32_t));
+  re->max_pool = RE_DFA_BYTES / sizeof(*re->pool);
+  re->trans = xmalloc((size_t)re->max_states * row);
+  re->states = xmalloc(re->max_states * sizeof(*re->states));
+  re->pool = xmalloc(re->max_pool * sizeof(*re->pool));
+  for (re->table_mask = 1; re->table_mask < 2 * re->max_states;)
+    re->table_mask *= 2;
+  re->table = xmalloc(re->table_mask * sizeof(*re->table));
+  re->table_mask--;
+  dfa_flush(re);
+  return re;
+}
+
+void mb_regex_free(mb_regex *re) {
+  if (re == NULL)
+    return;
+  for (int i = 0; i < 4; i++) {
+    free(re->ss[i].dense);
+    free(re->ss[i].sparse);
+  }
+  free(re->prog);
+  free(re->sets);
+  free(re->stack);
+  free(re->key);
+  free(re->trans);
+  free(re->states);
+  free(re->pool);
+  free(re->table);
+  free(re);
+}
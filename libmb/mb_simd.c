@@ -0,0 +1,54 @@
+/* MiniBox is a busybox/toybox like replacement aiming to be lightweight,
+ * portable, and memory efficient.
+ *
+ * Copyright (C) 2024 Robert Johnson et al <mitnew842@gmail.com>.
+ * All Rights Reserved.
+ *
+ * Licensed under Unlicense License, see file LICENSE in this source tree.
+ *
+ * When adding programs or features, please consider if they can be
+ * accomplished in a sane way with standard unix tools. If they're
+ * programs or features you added, please make sure they are read-
+ * able and understandable by a novice-advanced programmer, if not,
+ * add comments or let me know. Use common sense and please don't
+ * bloat sources.
+ *
+ * I haven't tested but it could compile on windows systems with MSYS/MinGW or
+ * Cygwin. MiniBox should be fairly portable for POSIX systems.
+ *
+ * Licensed under Unlicense License, see file LICENSE in this source tree.
+ */
+#include "libmb.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <cpuid.h>
+#endif
+
+// Widest vector instruction set the CPU and the OS support, checked once.
+// Threads may race to do the check, they all store the same result.
+int mb_simd_level(void) {
+  static int cached = -1;
+  int level = __atomic_load_n(&cached, __ATOMIC_RELAXED);
+
+  if (level >= 0)
+    return level;
+  level = MB_SIMD_NONE;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+  unsigned a, b, c, d;
+
+  // AVX2 also needs the OS to save the YMM registers (OSXSAVE and XCR0)
+  if (__get_cpuid(1, &a, &b, &c, &d)) {
+    unsigned xcr0 = 0;
+
+    if (d & bit_SSE2)
+      level = MB_SIMD_SSE2;
+    if (c & bit_OSXSAVE)
+      __asm__("xgetbv" : "=a"(xcr0), "=d"(a) : "c"(0));
+    if ((c & bit_POPCNT) && (xcr0 & 6) == 6 &&
+        __get_cpuid_count(7, 0, &a, &b, &c, &d) && (b & bit_AVX2))
+      level = MB_SIMD_AVX2;
+  }
+#endif
+  __atomic_store_n(&cached, level, __ATOMIC_RELAXED);
+  return level;
+}
@@ -0,0 +1,82 @@
+/* MiniBox is a busybox/toybox like replacement aiming to be lightweight,
+ * portable, and memory efficient.
+ *
+ * Copyright (C) 2024 Robert Johnson et al <mitnew842@gmail.com>.
+ * All Rights Reserved.
+ *
+ * Licensed under Unlicense License, see file LICENSE in this source tree.
+ *
+ * When adding programs or features, please consider if they can be
+ * accomplished in a sane way with standard unix tools. If they're
+ * programs or features you added, please make sure they are read-
+ * able and understandable by a novice-advanced programmer, if not,
+ * add comments or let me know. Use common sense and please don't
+ * bloat sources.
+ *
+ * I haven't tested but it could compile on windows systems with MSYS/MinGW or
+ * Cygwin. MiniBox should be fairly portable for POSIX systems.
+ *
+ * Licensed under Unlicense License, see file LICENSE in this source tree.
+ */
+#include "libmb.h"
+
+// Output to a terminal is flushed per line so it shows up as it is produced,
+// anything else is only written in MB_BUFSIZ chunks
+void mb_writer_init(mb_writer *w, int fd) {
+  void *ptr;
+
+  memset(w, 0, sizeof(*w));
+  w->fd = fd;
+  w->policy = isatty(fd) ? MB_FLUSH_LINE : MB_FLUSH_FULL;
+  if (posix_memalign(&ptr, MB_ALIGN, MB_BUFSIZ) != 0)
+    abort();
+  w->buf = ptr;
+}
+
+static int write_all(mb_writer *w, const char *p, size_t len) {
+  while (len > 0) {
+    ssize_t n = write(w->fd, p, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      w->error = errno;
+      return -1;
+    }
+    p += n;
+    len -= n;
+  }
+  return 0;
+}
+
+int mb_flush(mb_writer *w) {
+  size_t len = w->len;
+
+  w->len = 0;
+  return write_all(w, w->buf, len);
+}
+
+int mb_write(mb_writer *w, const void *data, size_t len) {
+  const char *p = data;
+
+  if (w->len + len > MB_BUFSIZ) {
+    if (mb_flush(w) < 0)
+      return -1;
+    // Big chunks go straight from the caller's buffer, no copy
+    if (len >= MB_BUFSIZ)
+      return write_all(w, p, len);
+  }
+  memcpy(w->buf + w->len, p, len);
+  w->len += len;
+  if (w->policy == MB_FLUSH_LINE && memchr(p, '\n', len))
+    return mb_flush(w);
+  return 0;
+}
+
+// Flush what is left and release the buffer, the descriptor stays open
+int mb_writer_free(mb_writer *w) {
+  int ret = mb_flush(w);
+
+  free(w->buf);
+  w->buf = NULL;
+  return ret;
+}
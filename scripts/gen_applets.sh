@@ -0,0 +1,101 @@
+#!/bin/bash
+
+# Purpose:
+# This script generates `include/applets.h`, the command dispatch table used by
+# src/minibox.c. It is run by the Makefile with the PROGS list as arguments:
+#
+#   ./scripts/gen_applets.sh wc cp cat ... > include/applets.h
+#
+# Only the programs enabled in include/config.h are put in the table (all of
+# them if ./configure hasn't been run yet). The function of each program is
+# taken from its own source file, it is the one non static function with the
+# `int name(int argc, char *argv[])` signature in src/<program>.c.
+#
+# Instead of scanning the table with strcmp on every invocation, a seed is
+# searched for which the hash below puts every program in its own slot. At
+# run time minibox hashes argv[0] once, looks at that single slot and compares
+# the length and the bytes of just that one candidate. The hash has to be kept
+# in sync with applet_hash() in src/minibox.c.
+
+SRC_DIR="src"
+CONFIG_H="include/config.h"
+
+names=()
+funcs=()
+for prog in "$@"; do
+    define="CONFIG_${prog^^}"
+    if [ -f "$CONFIG_H" ] && ! grep -q "^#define $define 1" "$CONFIG_H"; then
+        continue
+    fi
+
+    func=$(grep -hoE '^int [A-Za-z_0-9]+\(int argc, char \*argv\[\]\)' \
+        "$SRC_DIR/$prog.c" | sed -E 's/^int ([^(]*).*/\1/')
+    if [ -z "$func" ]; then
+        echo "gen_applets.sh: no entry function found in $SRC_DIR/$prog.c" >&2
+        exit 1
+    fi
+
+    names+=("$prog")
+    funcs+=("$func")
+done
+
+# FNV-1a seeded with the offset basis and finalized with a xor-shift, done in
+# 32 bits to match the uint32_t arithmetic of the C side
+hash() {
+    local s="$1" h=$2 i c
+    for ((i = 0; i < ${#s}; i++)); do
+        printf -v c '%d' "'${s:i:1}"
+        h=$(( ((h ^ c) * 16777619) & 0xffffffff ))
+    done
+    echo $(( h ^ (h >> 15) ))
+}
+
+# Start with a table 4 times bigger than the number of programs, that keeps
+# the seed search short, and grow it if no seed works
+size=4
+while [ $size -lt $(( ${#names[@]} * 4 )) ]; do
+    size=$(( size * 2 ))
+done
+
+found=0
+while [ $found -eq 0 ]; do
+    mask=$(( size - 1 ))
+    for ((seed = 2166136261; seed < 2166136261 + 1000; seed++)); do
+        slots=()
+        found=1
+        for i in "${!names[@]}"; do
+            slot=$(( $(hash "${names[i]}" $seed) & mask ))
+            if [ -n "${slots[slot]}" ]; then
+                found=0
+                break
+            fi
+            slots[slot]=$(( i + 1 ))
+        done
+        [ $found -eq 1 ] && break
+    done
+    [ $found -eq 0 ] && size=$(( size * 2 ))
+done
+
+echo "/* Auto-generated by scripts/gen_applets.sh, do not edit */"
+echo "#ifndef APPLETS_H"
+echo "#define APPLETS_H"
+echo ""
+echo "#define APPLET_HASH_SEED ${seed}u"
+echo "#define APPLET_HASH_MASK ${mask}u"
+echo ""
+echo "// Programs in PROGS order"
+echo "static const Command commands[] = {"
+for i in "${!names[@]}"; do
+    echo "    {\"${names[i]}\", ${#names[i]}, ${funcs[i]}},"
+done
+echo "    {\"\", 0, NULL}, // Keeps the table valid when nothing is enabled"
+echo "};"
+echo ""
+echo "// Hash slot -> index + 1 into commands[], 0 is an empty slot"
+echo "static const unsigned char command_slots[${size}] = {"
+for ((i = 0; i < size; i++)); do
+    [ -n "${slots[i]}" ] && echo "    [$i] = ${slots[i]},"
+done
+echo "};"
+echo ""
+echo "#endif /* APPLETS_H */"
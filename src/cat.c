@@ -1,51 +1,332 @@
+#ifdef __linux__
+#define _GNU_SOURCE // copy_file_range() and splice()
+#include <sys/sendfile.h>
+#endif
 #include "minibox.h"
+#include "libmb.h"
 
-#define BUFFER_SIZE 1024
+#include <sys/stat.h>
+
+#define KERNEL_CHUNK (1 << 30) // Bytes asked for per kernel copy call
+
+// What -n -b -s -v -E -T ask for, any of them turns the copy into a
+// transform. The state goes on from one file to the next like in one stream.
+static int number, number_nonblank, squeeze, show_nonprinting, show_ends,
+    show_tabs;
+static int transform;
+static int line_start = 1; // The next byte starts a line
+static int prev_blank;     // The last line written was empty
+static int pending_cr;     // A \r ended the last block, -E shows \r\n as ^M$
+static int progress;       // --progress
+
+// Line number as "%6d\t", counted up in its text instead of formatted for
+// each line. It grows to the left past six digits.
+static char num_buf[32] = "                          0\t";
+static char *num_start = num_buf + 21;
+static char *const num_end = num_buf + 28;
+
+// Bytes -v or -T write in ^ or M- notation
+static unsigned char special[256];
+
+#ifdef __linux__
+// Let the kernel move the data without it coming to user space:
+// copy_file_range() between regular files (the filesystem may share the
+// extents or copy on the device), splice() when either end is a pipe and
+// sendfile() for the rest, mostly a file to a tty or a socket. Returns 1 if
+// the input was copied to its end, 0 if the caller has to copy the rest
+// (the descriptor offsets are where the kernel stopped, so nothing is lost
+// or copied twice). Errors, including the ones only saying that the call
+// does not fit these descriptors, also return 0: the copy by the caller
+// reports the real ones. So does an input where nothing was copied, files
+// in /proc and /sys look empty to copy_file_range().
+static int cat_kernel(int fd, int out, const struct stat *out_st) {
+  struct stat st;
+  ssize_t n;
+  off_t total = 0;
+  // Smaller steps with --progress, or a whole file could be one jump
+  size_t chunk = progress ? MB_PROGRESS_CHUNK : KERNEL_CHUNK;
+
+  if (fstat(fd, &st) < 0)
+    return 0;
+  do {
+    if (S_ISREG(st.st_mode) && S_ISREG(out_st->st_mode))
+      n = copy_file_range(fd, NULL, out, NULL, chunk, 0);
+    else if (S_ISFIFO(st.st_mode) || S_ISFIFO(out_st->st_mode))
+      n = splice(fd, NULL, out, NULL, chunk, SPLICE_F_MOVE);
+    else
+      n = sendfile(out, fd, NULL, chunk);
+    if (n > 0) {
+      total += n;
+      mb_progress_add(n);
+    }
+  } while (n > 0 || (n < 0 && errno == EINTR));
+  return n == 0 && total > 0;
+}
+#endif
+
+static void put_number(mb_writer *w) {
+  char *q = num_end - 2;
+
+  while (*q == '9')
+    *q-- = '0';
+  *q = *q == ' ' ? '1' : *q + 1;
+  if (q < num_start)
+    num_start = q;
+  mb_write(w, num_start, num_end - num_start);
+}
+
+// Whether one of the 8 bytes of x may need ^ or M- notation: it has the
+// high bit set, is below the space or is DEL. A tab is a false alarm.
+static int maybe_special(uint64_t x) {
+  const uint64_t ones = 0x0101010101010101ull, highs = ones * 0x80;
+  uint64_t del = x ^ (ones * 0x7f);
+
+  return ((x | ((x - ones * ' ') & ~x) | ((del - ones) & ~del)) & highs) != 0;
+}
+
+// The first byte of [p, end) that needs ^ or M- notation, looking at 8 of
+// them at a time
+static const unsigned char *plain_run(const unsigned char *p,
+                                      const unsigned char *end) {
+  uint64_t x;
+
+  for (; end - p >= 8; p += 8) {
+    memcpy(&x, p, 8);
+    if (!maybe_special(x))
+      continue;
+    for (int i = 0; i < 8; i++) {
+      if (special[p[i]])
+        return p + i;
+    }
+  }
+  while (p < end && !special[*p])
+    p++;
+  return p;
+}
+
+// Write [p, end), which holds no newline, in ^ and M- notation. Runs of
+// bytes that need none are written as they are.
+static void put_visible(mb_writer *w, const unsigned char *p,
+                        const unsigned char *end) {
+  while (p < end) {
+    const unsigned char *run = p;
+    char esc[4];
+    int n = 0, c;
+
+    p = plain_run(p, end);
+    mb_write(w, run, p - run);
+    if (p == end)
+      break;
+    c = *p++;
+    if (c >= 128) {
+      esc[n++] = 'M';
+      esc[n++] = '-';
+      c -= 128;
+    }
+    if (c < ' ' || c == 127) {
+      esc[n++] = '^';
+      c ^= 64;
+    }
+    esc[n++] = c;
+    mb_write(w, esc, n);
+  }
+}
+
+// The transforms, a block at a time: every line found with memchr() is
+// written with a few calls into the output buffer, whatever its length
+static void cat_block(mb_writer *w, const char *p, const char *end) {
+  if (pending_cr) {
+    mb_write(w, *p == '\n' ? "^M" : "\r", *p == '\n' ? 2 : 1);
+    pending_cr = 0;
+  }
+  while (p < end) {
+    const char *nl, *stop;
+
+    if (line_start) {
+      if (*p == '\n') {
+        p++;
+        if (squeeze && prev_blank)
+          continue;
+        prev_blank = 1;
+        if (number && !number_nonblank)
+          put_number(w);
+        mb_write(w, show_ends ? "$\n" : "\n", show_ends ? 2 : 1);
+        continue;
+      }
+      prev_blank = 0;
+      line_start = 0;
+      if (number)
+        put_number(w);
+    }
+
+    nl = memchr(p, '\n', end - p);
+    stop = nl ? nl : end;
+    if (show_ends && !show_nonprinting && stop > p && stop[-1] == '\r') {
+      // Not known yet if the next block starts with the newline
+      stop--;
+      pending_cr = nl == NULL;
+    }
+    if (!show_nonprinting && !show_tabs)
+      mb_write(w, p, stop - p);
+    else
+      put_visible(w, (const unsigned char *)p, (const unsigned char *)stop);
+    if (nl == NULL)
+      break;
+    if (stop < nl)
+      mb_write(w, "^M", 2);
+    mb_write(w, show_ends ? "$\n" : "\n", show_ends ? 2 : 1);
+    line_start = 1;
+    p = nl + 1;
+  }
+}
+
+// Copy one descriptor to stdout, returns -1 and reports on failure
+static int cat_fd(int fd, mb_writer *w, const struct stat *out_st,
+                  const char *what) {
+  mb_reader r;
+  char *p;
+  size_t len;
+  int ret = 0;
+
+#ifdef __linux__
+  // What is buffered has to come out before
+  if (!transform && mb_flush(w) == 0 && cat_kernel(fd, w->fd, out_st))
+    return 0;
+#endif
+  // Whatever the kernel could not do goes through one big aligned buffer
+  mb_reader_init(&r, fd);
+  while ((p = mb_next_block(&r, &len)) != NULL) {
+    mb_progress_add(len);
+    if (transform)
+      cat_block(w, p, p + len);
+    if (w->error || (!transform && mb_write(w, p, len) < 0)) {
+      errno = w->error;
+      perror("Error writing to stdout");
+      ret = -1;
+      break;
+    }
+  }
+  if (r.error) {
+    errno = r.error;
+    perror(what);
+    ret = -1;
+  }
+  mb_reader_free(&r);
+  return ret;
+}
 
 int cat(int argc, char *argv[]) {
-  char buffer[BUFFER_SIZE];
-  ssize_t bytes_read;
-  int fd;
+  mb_writer w;
+  struct stat out_st;
+  int fd, ret = EXIT_SUCCESS, nfiles = 0, only_files = 0;
 
-  if (argc == 1) {
-    // No files provided, read from stdin
-    while ((bytes_read = read(STDIN_FILENO, buffer, BUFFER_SIZE)) > 0) {
-      if (write(STDOUT_FILENO, buffer, bytes_read) != bytes_read) {
-        perror("Error writing to stdout");
+  // Options can come anywhere, the files are packed at the start of argv
+  for (int i = 1; i < argc; i++) {
+    char *arg = argv[i];
+
+    if (only_files || arg[0] != '-' || arg[1] == '\0') {
+      argv[++nfiles] = arg;
+      continue;
+    }
+    if (strcmp(arg, "--") == 0) {
+      only_files = 1;
+      continue;
+    }
+    if (strcmp(arg, "--progress") == 0) {
+      progress = 1;
+      continue;
+    }
+    for (int j = 1; arg[j]; j++) {
+      switch (arg[j]) {
+      case 'b':
+        number = number_nonblank = 1;
+        break;
+      case 'n':
+        number = 1;
+        break;
+      case 's':
+        squeeze = 1;
+        break;
+      case 'A': // -vET
+        show_nonprinting = show_ends = show_tabs = 1;
+        break;
+      case 'e': // -vE
+        show_nonprinting = show_ends = 1;
+        break;
+      case 't': // -vT
+        show_nonprinting = show_tabs = 1;
+        break;
+      case 'v':
+        show_nonprinting = 1;
+        break;
+      case 'E':
+        show_ends = 1;
+        break;
+      case 'T':
+        show_tabs = 1;
+        break;
+      case 'u': // Output is never held back for long anyway
+        break;
+      default:
+        fprintf(stderr, "%s: invalid option -- '%c'\n", argv[0], arg[j]);
+        fprintf(stderr, "Usage: %s [-AbeEnstTuv] [--progress] [file...]\n", argv[0]);
         return EXIT_FAILURE;
       }
     }
+  }
+  argc = nfiles + 1;
+  transform = number || squeeze || show_nonprinting || show_ends || show_tabs;
+  for (int c = 0; c < 256; c++) {
+    special[c] = show_nonprinting && c != '\t' && c != '\n' &&
+                 (c < ' ' || c >= 127);
+  }
+  special['\t'] = show_tabs;
 
-    if (bytes_read < 0) {
-      perror("Error reading from stdin");
-      return EXIT_FAILURE;
+  mb_writer_init(&w, STDOUT_FILENO);
+  if (fstat(STDOUT_FILENO, &out_st) < 0)
+    memset(&out_st, 0, sizeof(out_st));
+  if (progress) {
+    // The size is only known for regular files, a pipe gets no ETA
+    struct stat st;
+    uint64_t expected = 0;
+
+    for (int i = 1; i < argc; i++) {
+      if (stat(argv[i], &st) == 0 && S_ISREG(st.st_mode))
+        expected += st.st_size;
     }
+    if (argc == 1 && fstat(STDIN_FILENO, &st) == 0 && S_ISREG(st.st_mode))
+      expected = st.st_size;
+    mb_progress_start(expected);
+  }
+  if (argc == 1) {
+    // No files provided, read from stdin
+    if (cat_fd(STDIN_FILENO, &w, &out_st, "Error reading from stdin") < 0)
+      ret = EXIT_FAILURE;
   } else {
     // Files provided, read from each file
-    for (int i = 1; i < argc; i++) {
+    for (int i = 1; i < argc && ret == EXIT_SUCCESS; i++) {
       fd = open(argv[i], O_RDONLY);
       if (fd < 0) {
         perror("Error opening file");
-        return EXIT_FAILURE;
-      }
-
-      while ((bytes_read = read(fd, buffer, BUFFER_SIZE)) > 0) {
-        if (write(STDOUT_FILENO, buffer, bytes_read) != bytes_read) {
-          perror("Error writing to stdout");
-          close(fd);
-          return EXIT_FAILURE;
-        }
-      }
-
-      if (bytes_read < 0) {
-        perror("Error reading file");
-        close(fd);
-        return EXIT_FAILURE;
+        ret = EXIT_FAILURE;
+        break;
       }
 
+      if (cat_fd(fd, &w, &out_st, "Error reading file") < 0)
+        ret = EXIT_FAILURE;
       close(fd);
     }
   }
 
-  return EXIT_SUCCESS;
+  // The files are one stream, only a \r at the very end is no line end
+  if (pending_cr)
+    mb_write(&w, "\r", 1);
+  if (mb_writer_free(&w) < 0 && ret == EXIT_SUCCESS) {
+    errno = w.error;
+    perror("Error writing to stdout");
+    ret = EXIT_FAILURE;
+  }
+  if (progress)
+    mb_progress_stop();
+  return ret;
 }
@@ -21,6 +21,7 @@
  */
 
 #include "minibox.h"
+#include "libmb.h"
 
 /* cmp program */
 /* Usage: cmp [comparer] [comparent] */
@@ -33,32 +34,52 @@ int cmp(int argc, char *argv[]) {
   const char *file1 = argv[1];
   const char *file2 = argv[2];
 
-  FILE *f1 = fopen(file1, "rb");
-  FILE *f2 = fopen(file2, "rb");
-  if (!f1 || !f2) {
-    if (f1)
-      fclose(f1);
-    if (f2)
-      fclose(f2);
+  int fd1 = open(file1, O_RDONLY);
+  int fd2 = open(file2, O_RDONLY);
+  if (fd1 < 0 || fd2 < 0) {
+    if (fd1 >= 0)
+      close(fd1);
+    if (fd2 >= 0)
+      close(fd2);
     fprintf(stderr, "cmp: Cannot open file\n");
     return 2;
   }
 
+  // Compare whatever both readers have buffered, the blocks can differ in
+  // length so each side keeps its own position
+  mb_reader r1, r2;
+  char *p1 = NULL, *p2 = NULL;
+  size_t n1 = 0, n2 = 0;
   int ret = 0;
+
+  mb_reader_init(&r1, fd1);
+  mb_reader_init(&r2, fd2);
   while (1) {
-    int ch1 = fgetc(f1);
-    int ch2 = fgetc(f2);
-    if (ch1 != ch2) {
-      ret = 1;
+    if (n1 == 0 && (p1 = mb_next_block(&r1, &n1)) == NULL)
+      n1 = 0;
+    if (n2 == 0 && (p2 = mb_next_block(&r2, &n2)) == NULL)
+      n2 = 0;
+    if (n1 == 0 || n2 == 0) {
+      ret = n1 != n2;
       break;
     }
-    if (ch1 == EOF)
+
+    size_t n = n1 < n2 ? n1 : n2;
+    if (memcmp(p1, p2, n) != 0) {
+      ret = 1;
       break;
+    }
+    p1 += n;
+    p2 += n;
+    n1 -= n;
+    n2 -= n;
   }
 
   if (ret)
     printf("Files differ\n");
-  fclose(f1);
-  fclose(f2);
+  mb_reader_free(&r1);
+  mb_reader_free(&r2);
+  close(fd1);
+  close(fd2);
   return ret;
 }
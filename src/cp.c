@@ -1,45 +1,636 @@
+#ifdef __linux__
+#define _GNU_SOURCE // copy_file_range() and SEEK_DATA
+#endif
 #include "minibox.h"
+#include "libmb.h"
 
-#define BUFFER_SIZE 1024
+#include <pthread.h>
+#include <sys/stat.h>
 
-int cp(int argc, char *argv[]) {
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s <source_file> <destination_file>\n", argv[0]);
-    return EXIT_FAILURE;
+#define CP_BUFSIZ (1024 * 1024)   // Buffer when the kernel can't copy
+#define KERNEL_CHUNK (1 << 30)    // Bytes asked for per copy_file_range()
+#define MAX_THREADS 64
+#define THREADS_PER_CPU 4 // Copies mostly wait on the filesystem, not the CPU
+#define QUEUE_SIZE 1024   // Files queued ahead of the copying threads
+
+#if defined(__linux__) && !defined(FICLONE)
+#define FICLONE _IOW(0x94, 9, int) // From linux/fs.h, which clashes with libc
+#endif
+
+static int recursive;     // -r -R -a, directories are copied
+static int no_dereference; // Symlinks are copied as symlinks, with -r
+static int preserve;      // -p -a, mode, ownership and times
+static int preserve_links; // -a, hard links stay hard links
+static mode_t mask;        // The umask, for the mode of new directories
+static int failed;         // Atomic, an error was reported
+static int progress;       // --progress
+
+static void cp_error(const char *what, const char *path) {
+  fprintf(stderr, "cp: %s '%s': %s\n", what, path, strerror(errno));
+  __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+}
+
+// Copy len bytes at off of in to the same offset of out: copy_file_range()
+// first, the filesystem may share the blocks or copy them on the device,
+// and a buffer for whatever it refuses. Returns the offset reached, which
+// is short of off + len if in ended early, or -1 after reporting an error.
+static off_t copy_range(int in, int out, off_t off, off_t len, char **buf,
+                      const char *src, const char *dst) {
+  ssize_t n;
+
+#ifdef __linux__
+  // Smaller steps with --progress, or a whole file could be one jump
+  off_t chunk = progress ? MB_PROGRESS_CHUNK : KERNEL_CHUNK;
+
+  while (len > 0) {
+    off_t in_off = off, out_off = off;
+
+    n = copy_file_range(in, &in_off, out, &out_off, len < chunk ? len : chunk,
+                        0);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n == 0)
+      return off; // The source got shorter
+    if (n < 0)
+      break; // Not for these files, the buffer reports real errors
+    mb_progress_add(n);
+    off += n;
+    len -= n;
   }
+#endif
+  if (len > 0 && *buf == NULL)
+    *buf = xmalloc(CP_BUFSIZ);
+  while (len > 0) {
+    n = pread(in, *buf, len < CP_BUFSIZ ? len : CP_BUFSIZ, off);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      cp_error("error reading", src);
+      return -1;
+    }
+    if (n == 0)
+      return off;
+    for (ssize_t done = 0; done < n;) {
+      ssize_t k = pwrite(out, *buf + done, n - done, off + done);
 
-  int src_fd = open(argv[1], O_RDONLY);
-  if (src_fd < 0) {
-    perror("Error opening source file");
-    return EXIT_FAILURE;
+      if (k < 0 && errno == EINTR)
+        continue;
+      if (k < 0) {
+        cp_error("error writing", dst);
+        return -1;
+      }
+      done += k;
+    }
+    mb_progress_add(n);
+    off += n;
+    len -= n;
   }
+  return off;
+}
 
-  int dest_fd = open(argv[2], O_WRONLY | O_CREAT | O_TRUNC, 0644);
-  if (dest_fd < 0) {
-    perror("Error opening destination file");
-    close(src_fd);
-    return EXIT_FAILURE;
+// Anything that isn't a regular file (or looks empty, like the files in
+// /proc) is read to its end through the block reader
+static int copy_stream(int in, int out, const char *src, const char *dst) {
+  mb_reader r;
+  mb_writer w;
+  char *p;
+  size_t len;
+  int ret = 0;
+
+  mb_reader_init(&r, in);
+  mb_writer_init(&w, out);
+  while ((p = mb_next_block(&r, &len)) != NULL) {
+    mb_progress_add(len);
+    if (mb_write(&w, p, len) < 0)
+      break;
+  }
+  if (mb_writer_free(&w) < 0) {
+    errno = w.error;
+    cp_error("error writing", dst);
+    ret = -1;
+  }
+  if (r.error) {
+    errno = r.error;
+    cp_error("error reading", src);
+    ret = -1;
+  }
+  mb_reader_free(&r);
+  return ret;
+}
+
+// Copy the data of in to the empty out. A reflink shares all the blocks at
+// once. Otherwise a file with fewer blocks than its size has holes: only
+// its data ranges are copied, found with SEEK_DATA and SEEK_HOLE, and the
+// holes are left unwritten in out too. Files that end before their size,
+// like those in /sys, are cut where their data ended.
+static int copy_data(int in, int out, const struct stat *st,
+                     const struct stat *out_st, const char *src,
+                     const char *dst) {
+  char *buf = NULL;
+  off_t data, hole = 0, size = st->st_size, end;
+  int ret = 0;
+
+  if (!S_ISREG(st->st_mode) || !S_ISREG(out_st->st_mode) || st->st_size == 0)
+    return copy_stream(in, out, src, dst);
+#ifdef __linux__
+  if (ioctl(out, FICLONE, in) == 0) {
+    mb_progress_add(st->st_size);
+    return 0;
+  }
+
+  if ((off_t)st->st_blocks * 512 < st->st_size) {
+    while (ret == 0 && hole < size) {
+      data = lseek(in, hole, SEEK_DATA);
+      if (data < 0 && errno == ENXIO)
+        data = st->st_size; // Only a hole left
+      else if (data < 0)
+        goto whole; // No SEEK_DATA on this filesystem
+      mb_progress_add(data - hole); // Holes count as copied
+      if (data == st->st_size)
+        break;
+      hole = lseek(in, data, SEEK_HOLE);
+      if (hole < 0)
+        hole = st->st_size;
+      end = copy_range(in, out, data, hole - data, &buf, src, dst);
+      if (end < 0)
+        ret = -1;
+      else if (end < hole)
+        size = end;
+    }
+    // A hole at the end is only the size
+    if (ret == 0 && ftruncate(out, size) < 0) {
+      cp_error("error writing", dst);
+      ret = -1;
+    }
+    free(buf);
+    return ret;
+  }
+whole:
+#endif
+  if (copy_range(in, out, 0, st->st_size, &buf, src, dst) < 0)
+    ret = -1;
+  free(buf);
+  return ret;
+}
+
+// Ownership, then the mode (chown clears the set-id bits) and the times of
+// a copy that isn't open. Like other cps, ownership is kept if allowed.
+static void preserve_path(const char *dst, const struct stat *st) {
+  struct timespec times[2] = {st->st_atim, st->st_mtim};
+
+  if (lchown(dst, st->st_uid, st->st_gid) < 0 && errno != EPERM)
+    cp_error("cannot preserve ownership of", dst);
+  if (!S_ISLNK(st->st_mode) && chmod(dst, st->st_mode & 07777) < 0)
+    cp_error("cannot preserve permissions of", dst);
+  if (utimensat(AT_FDCWD, dst, times, AT_SYMLINK_NOFOLLOW) < 0)
+    cp_error("cannot preserve times of", dst);
+}
+
+// Hard links seen with -a: the first copy of an inode is made as usual,
+// the other names become links to it once all the copies are done
+typedef struct {
+  dev_t dev;
+  ino_t ino;
+  char *dst;
+} inode_entry;
+
+typedef struct {
+  char *target, *dst;
+} later_link;
+
+static pthread_mutex_t links_lock = PTHREAD_MUTEX_INITIALIZER;
+static inode_entry *inodes; // Open addressing, the size is a power of two
+static size_t ninodes, inodes_size;
+static later_link *later;
+static size_t nlater, later_cap;
+
+static size_t inode_slot(dev_t dev, ino_t ino) {
+  size_t i = ((uint64_t)ino * 0x9e3779b97f4a7c15ull ^ dev) & (inodes_size - 1);
+
+  while (inodes[i].dst &&
+         (inodes[i].dev != dev || inodes[i].ino != ino))
+    i = (i + 1) & (inodes_size - 1);
+  return i;
+}
+
+// Returns 1 if dst is to be a link to an inode copied before
+static int link_seen(const struct stat *st, const char *dst) {
+  int seen = 0;
+  size_t i;
+
+  pthread_mutex_lock(&links_lock);
+  if (2 * (ninodes + 1) > inodes_size) {
+    inode_entry *old = inodes;
+    size_t old_size = inodes_size;
+
+    inodes_size = inodes_size ? inodes_size * 2 : 64;
+    inodes = xzalloc(inodes_size * sizeof(*inodes));
+    for (size_t k = 0; k < old_size; k++) {
+      if (old[k].dst)
+        inodes[inode_slot(old[k].dev, old[k].ino)] = old[k];
+    }
+    free(old);
+  }
+  i = inode_slot(st->st_dev, st->st_ino);
+  if (inodes[i].dst) {
+    if (nlater == later_cap) {
+      later_cap = later_cap ? later_cap * 2 : 64;
+      later = xrealloc(later, later_cap * sizeof(*later));
+    }
+    later[nlater].target = inodes[i].dst;
+    later[nlater++].dst = strcpy(xmalloc(strlen(dst) + 1), dst);
+    seen = 1;
+  } else {
+    inodes[i].dev = st->st_dev;
+    inodes[i].ino = st->st_ino;
+    inodes[i].dst = strcpy(xmalloc(strlen(dst) + 1), dst);
+    ninodes++;
+  }
+  pthread_mutex_unlock(&links_lock);
+  return seen;
+}
+
+static void make_links(void) {
+  for (size_t i = 0; i < nlater; i++) {
+    if (link(later[i].target, later[i].dst) < 0 &&
+        (errno != EEXIST || unlink(later[i].dst) < 0 ||
+         link(later[i].target, later[i].dst) < 0))
+      cp_error("cannot create hard link", later[i].dst);
+    free(later[i].dst);
+  }
+  for (size_t i = 0; i < inodes_size; i++)
+    free(inodes[i].dst);
+  free(inodes);
+  free(later);
+}
+
+static void copy_symlink(const char *src, const char *dst,
+                         const struct stat *st) {
+  char target[PATH_MAX];
+  ssize_t n = readlink(src, target, sizeof(target) - 1);
+
+  if (n < 0) {
+    cp_error("cannot read symbolic link", src);
+    return;
+  }
+  target[n] = '\0';
+  if (symlink(target, dst) < 0 &&
+      (errno != EEXIST || unlink(dst) < 0 || symlink(target, dst) < 0)) {
+    cp_error("cannot create symbolic link", dst);
+    return;
+  }
+  if (preserve)
+    preserve_path(dst, st);
+}
+
+// Copy one file that isn't a directory, this is what the threads run
+static void copy_file(const char *src, const char *dst) {
+  struct stat st, out_st;
+  int in, out;
+
+  if ((no_dereference ? lstat(src, &st) : stat(src, &st)) < 0) {
+    cp_error("cannot stat", src);
+    return;
+  }
+  if (preserve_links && st.st_nlink > 1 && link_seen(&st, dst))
+    return;
+  if (S_ISLNK(st.st_mode)) {
+    copy_symlink(src, dst, &st);
+    return;
+  }
+  // -r makes new fifos and devices instead of copying what they give
+  if (recursive && !S_ISREG(st.st_mode)) {
+    if (mknod(dst, st.st_mode, st.st_rdev) < 0)
+      cp_error("cannot create special file", dst);
+    else if (preserve)
+      preserve_path(dst, &st);
+    return;
+  }
+
+  if ((in = open(src, O_RDONLY)) < 0) {
+    cp_error("cannot open", src);
+    return;
   }
+  // No O_TRUNC before knowing that this isn't the source itself
+  if ((out = open(dst, O_WRONLY | O_CREAT, st.st_mode & 0777)) < 0) {
+    cp_error("cannot create regular file", dst);
+    close(in);
+    return;
+  }
+  if (fstat(out, &out_st) < 0) {
+    cp_error("cannot stat", dst);
+  } else if (out_st.st_dev == st.st_dev && out_st.st_ino == st.st_ino) {
+    fprintf(stderr, "cp: '%s' and '%s' are the same file\n", src, dst);
+    __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+  } else if (out_st.st_size > 0 && ftruncate(out, 0) < 0) {
+    cp_error("cannot truncate", dst);
+  } else if (copy_data(in, out, &st, &out_st, src, dst) == 0 && preserve) {
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+
+    if (fchown(out, st.st_uid, st.st_gid) < 0 && errno != EPERM)
+      cp_error("cannot preserve ownership of", dst);
+    if (fchmod(out, st.st_mode & 07777) < 0)
+      cp_error("cannot preserve permissions of", dst);
+    if (futimens(out, times) < 0)
+      cp_error("cannot preserve times of", dst);
+  }
+  close(in);
+  if (close(out) < 0)
+    cp_error("error writing", dst);
+  if (recursive)
+    mb_progress_file();
+}
 
-  char buffer[BUFFER_SIZE];
-  ssize_t bytes_read, bytes_written;
+// The copying threads take files from a bounded queue filled by the main
+// thread, which walks the tree and makes the directories in order. Before
+// the first directory (and without -r) files are copied right away.
+typedef struct {
+  char *src, *dst;
+} cp_job;
 
-  while ((bytes_read = read(src_fd, buffer, BUFFER_SIZE)) > 0) {
-    bytes_written = write(dest_fd, buffer, bytes_read);
-    if (bytes_written != bytes_read) {
-      perror("Error writing to destination file");
-      close(src_fd);
-      close(dest_fd);
-      return EXIT_FAILURE;
+static cp_job queue[QUEUE_SIZE];
+static size_t queue_head, queue_len;
+static int queue_closed;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_filled = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_drained = PTHREAD_COND_INITIALIZER;
+static pthread_t threads[MAX_THREADS];
+static int nthreads;
+
+static void *copy_worker(void *arg) {
+  cp_job job;
+
+  for (;;) {
+    pthread_mutex_lock(&queue_lock);
+    while (queue_len == 0 && !queue_closed)
+      pthread_cond_wait(&queue_filled, &queue_lock);
+    if (queue_len == 0) {
+      pthread_mutex_unlock(&queue_lock);
+      return NULL;
     }
+    job = queue[queue_head];
+    queue_head = (queue_head + 1) % QUEUE_SIZE;
+    queue_len--;
+    pthread_cond_signal(&queue_drained);
+    pthread_mutex_unlock(&queue_lock);
+
+    copy_file(job.src, job.dst);
+    free(job.src);
+    free(job.dst);
+  }
+}
+
+static void pool_start(void) {
+  long n = sysconf(_SC_NPROCESSORS_ONLN) * THREADS_PER_CPU;
+
+  if (n < 1)
+    n = 1;
+  if (n > MAX_THREADS)
+    n = MAX_THREADS;
+  while (nthreads < n &&
+         pthread_create(&threads[nthreads], NULL, copy_worker, NULL) == 0)
+    nthreads++;
+}
+
+static void pool_finish(void) {
+  pthread_mutex_lock(&queue_lock);
+  queue_closed = 1;
+  pthread_cond_broadcast(&queue_filled);
+  pthread_mutex_unlock(&queue_lock);
+  for (int i = 0; i < nthreads; i++)
+    pthread_join(threads[i], NULL);
+}
+
+// Takes src and dst, they are freed once copied
+static void submit(char *src, char *dst) {
+  if (nthreads == 0) {
+    copy_file(src, dst);
+    free(src);
+    free(dst);
+    return;
   }
+  pthread_mutex_lock(&queue_lock);
+  while (queue_len == QUEUE_SIZE)
+    pthread_cond_wait(&queue_drained, &queue_lock);
+  queue[(queue_head + queue_len++) % QUEUE_SIZE] = (cp_job){src, dst};
+  pthread_cond_signal(&queue_filled);
+  pthread_mutex_unlock(&queue_lock);
+}
+
+// Directories made, their mode and times are set when the copies are done
+// (the copies would change the times and a read-only mode stop them)
+typedef struct {
+  char *dst;
+  struct stat st;
+  int created;
+} made_dir;
+
+static made_dir *dirs;
+static size_t ndirs, dirs_cap;
+static const char *top_src, *top_dst; // The operand being copied
+static dev_t top_dev; // What top_dst is, a directory not to copy into
+static ino_t top_ino; // itself
+
+static char *join_path(const char *dir, const char *name) {
+  size_t len = strlen(dir);
+  char *path = xmalloc(len + strlen(name) + 2);
 
-  if (bytes_read < 0) {
-    perror("Error reading source file");
+  memcpy(path, dir, len);
+  if (len > 0 && dir[len - 1] != '/')
+    path[len++] = '/';
+  strcpy(path + len, name);
+  return path;
+}
+
+static void copy_dir(const char *src, const char *dst, const struct stat *st) {
+  struct stat dst_st;
+  DIR *d;
+  struct dirent *e;
+  int created = mkdir(dst, (st->st_mode & 07777) | S_IRWXU) == 0;
+
+  if (!created && (errno != EEXIST || stat(dst, &dst_st) < 0 ||
+                   !S_ISDIR(dst_st.st_mode))) {
+    cp_error("cannot create directory", dst);
+    return;
+  }
+  if (ndirs == dirs_cap) {
+    dirs_cap = dirs_cap ? dirs_cap * 2 : 64;
+    dirs = xrealloc(dirs, dirs_cap * sizeof(*dirs));
+  }
+  dirs[ndirs].dst = strcpy(xmalloc(strlen(dst) + 1), dst);
+  dirs[ndirs].st = *st;
+  dirs[ndirs++].created = created;
+  if (top_ino == 0 && stat(dst, &dst_st) == 0) {
+    top_dev = dst_st.st_dev;
+    top_ino = dst_st.st_ino;
+  }
+  if (nthreads == 0)
+    pool_start();
+
+  if ((d = opendir(src)) == NULL) {
+    cp_error("cannot open directory", src);
+    return;
+  }
+  while ((e = readdir(d)) != NULL) {
+    struct stat cst;
+    char *csrc, *cdst;
+
+    if (e->d_name[0] == '.' &&
+        (e->d_name[1] == '\0' || (e->d_name[1] == '.' && e->d_name[2] == '\0')))
+      continue;
+    csrc = join_path(src, e->d_name);
+    cdst = join_path(dst, e->d_name);
+    if (e->d_type != DT_DIR && e->d_type != DT_UNKNOWN) {
+      submit(csrc, cdst);
+      continue;
+    }
+    if (fstatat(dirfd(d), e->d_name, &cst, AT_SYMLINK_NOFOLLOW) < 0) {
+      cp_error("cannot stat", csrc);
+    } else if (!S_ISDIR(cst.st_mode)) {
+      submit(csrc, cdst);
+      continue;
+    } else if (cst.st_dev == top_dev && cst.st_ino == top_ino) {
+      fprintf(stderr, "cp: cannot copy a directory, '%s', into itself, '%s'\n",
+              top_src, top_dst);
+      __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+    } else {
+      copy_dir(csrc, cdst, &cst);
+    }
+    free(csrc);
+    free(cdst);
+  }
+  closedir(d);
+}
+
+// The deepest directories first, a parent's times change with its children
+static void finish_dirs(void) {
+  for (size_t i = ndirs; i-- > 0;) {
+    made_dir *m = &dirs[i];
+
+    if (preserve)
+      preserve_path(m->dst, &m->st);
+    else if (m->created && (m->st.st_mode & S_IRWXU) != S_IRWXU &&
+             chmod(m->dst, m->st.st_mode & 07777 & ~mask) < 0)
+      cp_error("cannot set permissions of", m->dst);
+    free(m->dst);
+  }
+  free(dirs);
+}
+
+static void copy_operand(const char *src, const char *dst) {
+  struct stat st;
+
+  if ((no_dereference ? lstat(src, &st) : stat(src, &st)) < 0) {
+    cp_error("cannot stat", src);
+    return;
+  }
+  if (!S_ISDIR(st.st_mode)) {
+    submit(strcpy(xmalloc(strlen(src) + 1), src),
+           strcpy(xmalloc(strlen(dst) + 1), dst));
+  } else if (!recursive) {
+    fprintf(stderr, "cp: -r not specified; omitting directory '%s'\n", src);
+    __atomic_store_n(&failed, 1, __ATOMIC_RELAXED);
+  } else {
+    top_src = src;
+    top_dst = dst;
+    top_ino = 0;
+    copy_dir(src, dst, &st);
+  }
+}
+
+int cp(int argc, char *argv[]) {
+  struct stat st;
+  int nfiles = 0, only_files = 0, to_dir;
+  char *dest;
+
+  // Options can come anywhere, the operands are packed at the start of argv
+  for (int i = 1; i < argc; i++) {
+    char *arg = argv[i];
+
+    if (only_files || arg[0] != '-' || arg[1] == '\0') {
+      argv[nfiles++] = arg;
+      continue;
+    }
+    if (strcmp(arg, "--") == 0) {
+      only_files = 1;
+      continue;
+    }
+    if (strcmp(arg, "--progress") == 0) {
+      progress = 1;
+      continue;
+    }
+    for (int j = 1; arg[j]; j++) {
+      switch (arg[j]) {
+      case 'r':
+      case 'R':
+        recursive = no_dereference = 1;
+        break;
+      case 'p':
+        preserve = 1;
+        break;
+      case 'a': // -R -p, symlinks and hard links as they are
+        recursive = no_dereference = preserve = preserve_links = 1;
+        break;
+      default:
+        fprintf(stderr, "cp: invalid option -- '%c'\n", arg[j]);
+        goto usage;
+      }
+    }
+  }
+  if (nfiles < 2)
+    goto usage;
+
+  mask = umask(0);
+  umask(mask);
+
+  // The last operand is where to copy, into it if it is a directory
+  dest = argv[--nfiles];
+  to_dir = stat(dest, &st) == 0 && S_ISDIR(st.st_mode);
+  if (nfiles > 1 && !to_dir) {
+    fprintf(stderr, "cp: target '%s': Not a directory\n", dest);
+    return EXIT_FAILURE;
+  }
+  if (progress) {
+    // The size is known up front unless a directory has to be walked
+    uint64_t expected = 0;
+
+    for (int i = 0; i < nfiles; i++) {
+      if (stat(argv[i], &st) < 0 || S_ISDIR(st.st_mode)) {
+        expected = 0;
+        break;
+      }
+      expected += S_ISREG(st.st_mode) ? st.st_size : 0;
+    }
+    mb_progress_start(expected);
+  }
+  for (int i = 0; i < nfiles; i++) {
+    char *src = argv[i], *name, *dst;
+    size_t len = strlen(src);
+
+    if (!to_dir) {
+      copy_operand(src, dest);
+      continue;
+    }
+    // The last name of the operand, without trailing slashes
+    while (len > 1 && src[len - 1] == '/')
+      len--;
+    name = memcpy(xmalloc(len + 1), src, len);
+    name[len] = '\0';
+    dst = join_path(dest, basename(name));
+    copy_operand(src, dst);
+    free(name);
+    free(dst);
   }
 
-  close(src_fd);
-  close(dest_fd);
+  if (nthreads > 0)
+    pool_finish();
+  if (preserve_links)
+    make_links();
+  finish_dirs();
+  mb_progress_stop();
+  return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 
-  return (bytes_read < 0) ? EXIT_FAILURE : EXIT_SUCCESS;
+usage:
+  fprintf(stderr, "Usage: cp [-aprR] [--progress] SOURCE... DEST\n");
+  return EXIT_FAILURE;
 }
@@ -20,155 +20,393 @@
  */
 
 #include "minibox.h"
+#include "libmb.h"
 
-/* cut program */
-int cut(int argc, char *argv[]) {
-  char delimiter = '\t';  // Default delimiter (tab)
-  char *field_str = NULL; // Field string
-  size_t num_fields = 0;
-  int *fields = NULL;
+#include <ctype.h>
 
-  // Parse command-line options manually
-  for (int i = 1; i < argc; i++) {
-    if (argv[i][0] == '-') {
-      if (strcmp(argv[i], "-d") == 0) {
-        if (i + 1 < argc) {
-          delimiter = argv[++i][0];
-        } else {
-          fprintf(stderr, "Error: Option -d requires an argument.\n");
-          return EXIT_FAILURE;
-        }
-      } else if (strcmp(argv[i], "-f") == 0) {
-        if (i + 1 < argc) {
-          field_str = argv[++i];
-        } else {
-          fprintf(stderr, "Error: Option -f requires an argument.\n");
-          return EXIT_FAILURE;
-        }
-      } else {
-        fprintf(stderr, "Usage: %s [-d delimiter] -f fields [file...]\n",
-                argv[0]);
-        return EXIT_FAILURE;
-      }
-    } else {
-      fprintf(stderr, "Usage: %s [-d delimiter] -f fields [file...]\n",
-              argv[0]);
-      return EXIT_FAILURE;
-    }
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define CUT_X86 1
+#endif
+
+// Positions or fields to print, sorted and merged, hi is SIZE_MAX for N-
+typedef struct {
+  size_t lo, hi;
+} cut_range;
+
+static cut_range *ranges;
+static size_t nranges;
+static int fields;                       // -f, else -b or -c
+static int only_delimited;               // -s
+static unsigned char delim = '\t';       // -d
+static const char *out_delim;            // --output-delimiter
+static size_t out_delim_len;
+static int join;                         // Adjacent fields go out as one slice
+
+// Where the next delimiter or newline is in [p, end), end if none
+typedef const char *sep_func(const char *p, const char *end);
+
+static const char *sep_scalar(const char *p, const char *end) {
+  while (p < end && *p != (char)delim && *p != '\n')
+    p++;
+  return p;
+}
+
+#ifdef CUT_X86
+// Both vector kernels compare a vector with the delimiter and the newline
+// at once and take the first bit of the two masks
+__attribute__((target("sse2"))) static const char *sep_sse2(const char *p,
+                                                            const char *end) {
+  const __m128i d = _mm_set1_epi8(delim), nl = _mm_set1_epi8('\n');
+
+  for (; end - p >= 16; p += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)p);
+    unsigned m = _mm_movemask_epi8(
+        _mm_or_si128(_mm_cmpeq_epi8(v, d), _mm_cmpeq_epi8(v, nl)));
+
+    if (m)
+      return p + __builtin_ctz(m);
   }
+  return sep_scalar(p, end);
+}
 
-  if (!field_str) {
-    fprintf(stderr, "Field specification is required.\n");
-    return EXIT_FAILURE;
+__attribute__((target("avx2"))) static const char *sep_avx2(const char *p,
+                                                            const char *end) {
+  const __m256i d = _mm256_set1_epi8(delim), nl = _mm256_set1_epi8('\n');
+
+  for (; end - p >= 32; p += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)p);
+    unsigned m = _mm256_movemask_epi8(
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, d), _mm256_cmpeq_epi8(v, nl)));
+
+    if (m)
+      return p + __builtin_ctz(m);
   }
+  return sep_scalar(p, end);
+}
+#endif
 
-  // Parse the field argument
-  size_t fields_capacity = 10;
-  fields = malloc(fields_capacity * sizeof(int));
-  if (!fields) {
-    perror("malloc");
-    return EXIT_FAILURE;
+static sep_func *find_sep = sep_scalar;
+
+// Pick the widest kernel the CPU running us supports
+static void select_kernel(void) {
+#ifdef CUT_X86
+  if (mb_simd_level() == MB_SIMD_AVX2)
+    find_sep = sep_avx2;
+  else if (mb_simd_level() == MB_SIMD_SSE2)
+    find_sep = sep_sse2;
+#endif
+}
+
+static int range_cmp(const void *a, const void *b) {
+  const cut_range *x = a, *y = b;
+
+  return x->lo < y->lo ? -1 : x->lo > y->lo;
+}
+
+// LIST is N, N-M, N- and -M separated by commas or blanks
+static int parse_list(const char *list, const char *what) {
+  const char *p = list;
+  size_t cap = 0, n = 0;
+
+  while (*p) {
+    cut_range r = {1, SIZE_MAX};
+    int numbers = 0;
+    char *end;
+
+    if (*p == ',' || isblank((unsigned char)*p)) {
+      p++;
+      continue;
+    }
+    if (isdigit((unsigned char)*p)) {
+      r.lo = r.hi = strtoul(p, &end, 10);
+      p = end;
+      numbers++;
+    }
+    if (*p == '-') {
+      p++;
+      r.hi = SIZE_MAX;
+      if (isdigit((unsigned char)*p)) {
+        r.hi = strtoul(p, &end, 10);
+        p = end;
+        numbers++;
+      }
+    }
+    if (numbers == 0 || (*p && *p != ',' && !isblank((unsigned char)*p)))
+      goto invalid;
+    if (r.lo == 0 || r.hi == 0) {
+      fprintf(stderr, "cut: %s are numbered from 1\n", what);
+      return -1;
+    }
+    if (r.hi < r.lo) {
+      fprintf(stderr, "cut: invalid decreasing range\n");
+      return -1;
+    }
+    if (n == cap) {
+      cap = cap ? cap * 2 : 8;
+      ranges = xrealloc(ranges, cap * sizeof(*ranges));
+    }
+    ranges[n++] = r;
   }
+  if (n == 0)
+    goto invalid;
 
-  char *str = strdup(field_str);
-  if (!str) {
-    perror("strdup");
-    free(fields);
-    return EXIT_FAILURE;
+  // Sorted and merged. Like other cuts, -b 1-2,3-4 stays two ranges that
+  // --output-delimiter goes between, only overlapping ones become one.
+  qsort(ranges, n, sizeof(*ranges), range_cmp);
+  nranges = 1;
+  for (size_t i = 1; i < n; i++) {
+    cut_range *last = &ranges[nranges - 1];
+
+    if (ranges[i].lo <= last->hi) {
+      if (ranges[i].hi > last->hi)
+        last->hi = ranges[i].hi;
+    } else {
+      ranges[nranges++] = ranges[i];
+    }
   }
+  return 0;
 
-  char *token = strtok(str, ",");
-  while (token != NULL) {
-    if (num_fields >= fields_capacity) {
-      fields_capacity *= 2;
-      fields = realloc(fields, fields_capacity * sizeof(int));
-      if (!fields) {
-        perror("realloc");
-        free(str);
-        return EXIT_FAILURE;
-      }
+invalid:
+  fprintf(stderr, "cut: invalid %s list '%s'\n",
+          fields ? "field" : "byte/character", list);
+  return -1;
+}
+
+// -b and -c: the selected bytes of each line, the slices of the line are
+// written as they are
+static void cut_bytes(const char *p, const char *end, mb_writer *w) {
+  while (p < end) {
+    const char *nl = memchr(p, '\n', end - p);
+    size_t len;
+
+    if (nl == NULL)
+      nl = end;
+    len = nl - p;
+    for (size_t r = 0; r < nranges && ranges[r].lo <= len; r++) {
+      size_t hi = ranges[r].hi < len ? ranges[r].hi : len;
+
+      if (r > 0 && out_delim)
+        mb_write(w, out_delim, out_delim_len);
+      mb_write(w, p + ranges[r].lo - 1, hi - ranges[r].lo + 1);
     }
-    fields[num_fields++] = atoi(token);
-    token = strtok(NULL, ",");
+    mb_write(w, "\n", 1);
+    p = nl + (nl < end);
   }
-  free(str);
+}
 
-  // Process lines from stdin or files
-  if (argc == 1 || (argc == 2 && argv[1][0] == '-' && argv[1][1] == 'f')) {
-    // No files specified, read from stdin
-    char line[1024];
-    while (fgets(line, sizeof(line), stdin)) {
-      char *temp_line = strdup(line);
-      if (!temp_line) {
-        perror("strdup");
-        free(fields);
-        return EXIT_FAILURE;
-      }
+// -f: fields are found with the delimiter scan. Selected fields next to
+// each other go out as one slice with the delimiters between them, and
+// the rest of a line after the last field wanted is skipped with memchr.
+static void cut_fields(const char *p, const char *end, mb_writer *w) {
+  size_t max_field = ranges[nranges - 1].hi;
 
-      char *token = strtok(temp_line, &delimiter);
-      int current_field = 1;
-      size_t field_index = 0;
+  while (p < end) {
+    const char *line = p, *start = p, *q, *slice = NULL, *slice_end = NULL;
+    size_t field = 1, r = 0, last_selected = 0;
+    int delimited = 0;
 
-      while (token != NULL) {
-        while (field_index < num_fields &&
-               fields[field_index] < current_field) {
-          field_index++;
+    for (;;) {
+      q = find_sep(start, end);
+      // The field from start to q is the last one when q is the line end
+      while (r < nranges && ranges[r].hi < field)
+        r++;
+      if (r < nranges && ranges[r].lo <= field &&
+          (delimited || (q < end && *q != '\n'))) {
+        if (slice && join && last_selected + 1 == field) {
+          slice_end = q;
+        } else {
+          if (slice) {
+            mb_write(w, slice, slice_end - slice);
+            mb_write(w, out_delim, out_delim_len);
+          }
+          slice = start;
+          slice_end = q;
         }
-        if (field_index < num_fields && fields[field_index] == current_field) {
-          printf("%s\n", token);
+        last_selected = field;
+        // From here on every field is printed, the rest of the line is
+        // one slice
+        if (join && ranges[r].hi == SIZE_MAX && q < end && *q != '\n') {
+          q = memchr(q, '\n', end - q);
+          if (q == NULL)
+            q = end;
+          slice_end = q;
+          delimited = 1;
+          break;
         }
-        current_field++;
-        token = strtok(NULL, &delimiter);
       }
-
-      free(temp_line);
+      if (q == end || *q == '\n')
+        break;
+      delimited = 1;
+      start = q + 1;
+      if (++field > max_field) {
+        q = memchr(start, '\n', end - start);
+        if (q == NULL)
+          q = end;
+        break;
+      }
     }
-  } else {
-    // Process each file
-    for (int i = 1; i < argc; i++) {
-      if (argv[i][0] == '-')
-        continue; // Skip options
 
-      FILE *file = fopen(argv[i], "r");
-      if (!file) {
-        perror(argv[i]);
-        continue;
+    if (!delimited) {
+      // A line without the delimiter is printed whole, unless -s
+      if (!only_delimited) {
+        mb_write(w, line, q - line);
+        mb_write(w, "\n", 1);
       }
+    } else {
+      if (slice)
+        mb_write(w, slice, slice_end - slice);
+      mb_write(w, "\n", 1);
+    }
+    p = q + (q < end);
+  }
+}
 
-      char line[1024];
-      while (fgets(line, sizeof(line), file)) {
-        char *temp_line = strdup(line);
-        if (!temp_line) {
-          perror("strdup");
-          fclose(file);
-          free(fields);
-          return EXIT_FAILURE;
-        }
+static int cut_fd(int fd, mb_writer *w) {
+  mb_reader r;
+  char *p;
+  size_t len;
+  int ret = 0;
 
-        char *token = strtok(temp_line, &delimiter);
-        int current_field = 1;
-        size_t field_index = 0;
+  // Slices of whole lines, a line is never cut in two between blocks
+  mb_reader_init(&r, fd);
+  while ((p = mb_next_lines(&r, &len)) != NULL) {
+    if (fields)
+      cut_fields(p, p + len, w);
+    else
+      cut_bytes(p, p + len, w);
+  }
+  if (r.error) {
+    errno = r.error;
+    ret = -1;
+  }
+  mb_reader_free(&r);
+  return ret;
+}
 
-        while (token != NULL) {
-          while (field_index < num_fields &&
-                 fields[field_index] < current_field) {
-            field_index++;
-          }
-          if (field_index < num_fields &&
-              fields[field_index] == current_field) {
-            printf("%s\n", token);
-          }
-          current_field++;
-          token = strtok(NULL, &delimiter);
-        }
+static void usage(void) {
+  fprintf(stderr, "Usage: cut -b LIST|-c LIST|-f LIST [-d DELIM] [-s] "
+                  "[--output-delimiter=STRING] [file...]\n");
+}
 
-        free(temp_line);
+int cut(int argc, char *argv[]) {
+  mb_writer w;
+  const char *list = NULL, *delim_arg = NULL;
+  int nfiles = 0, only_files = 0, ret = EXIT_SUCCESS;
+
+  // Options can come anywhere, the files are packed at the start of argv
+  for (int i = 1; i < argc; i++) {
+    char *arg = argv[i];
+
+    if (only_files || arg[0] != '-' || arg[1] == '\0') {
+      argv[nfiles++] = arg;
+      continue;
+    }
+    if (strcmp(arg, "--") == 0) {
+      only_files = 1;
+      continue;
+    }
+    if (strncmp(arg, "--output-delimiter", 18) == 0 &&
+        (arg[18] == '=' || arg[18] == '\0')) {
+      out_delim = arg[18] ? arg + 19 : argv[++i];
+      if (out_delim == NULL) {
+        fprintf(stderr, "cut: option '--output-delimiter' requires an "
+                        "argument\n");
+        usage();
+        return EXIT_FAILURE;
       }
+      continue;
+    }
+    for (int j = 1; arg[j]; j++) {
+      char c = arg[j];
+      const char *value;
 
-      fclose(file);
+      if (c == 's') {
+        only_delimited = 1;
+        continue;
+      }
+      if (c == 'n') // Multibyte characters are bytes here anyway
+        continue;
+      if (c != 'b' && c != 'c' && c != 'f' && c != 'd') {
+        fprintf(stderr, "cut: invalid option -- '%c'\n", c);
+        usage();
+        return EXIT_FAILURE;
+      }
+      // -f LIST or -fLIST
+      value = arg[j + 1] ? arg + j + 1 : argv[++i];
+      if (value == NULL) {
+        fprintf(stderr, "cut: option requires an argument -- '%c'\n", c);
+        usage();
+        return EXIT_FAILURE;
+      }
+      if (c == 'd') {
+        delim_arg = value;
+      } else if (list) {
+        fprintf(stderr, "cut: only one type of list may be specified\n");
+        return EXIT_FAILURE;
+      } else {
+        list = value;
+        fields = c == 'f';
+      }
+      break;
+    }
+  }
+
+  if (list == NULL) {
+    fprintf(stderr, "cut: you must specify a list of bytes, characters, or "
+                    "fields\n");
+    usage();
+    return EXIT_FAILURE;
+  }
+  if (!fields && delim_arg) {
+    fprintf(stderr, "cut: an input delimiter may be specified only when "
+                    "operating on fields\n");
+    return EXIT_FAILURE;
+  }
+  if (!fields && only_delimited) {
+    fprintf(stderr, "cut: suppressing non-delimited lines makes sense\n"
+                    "\tonly when operating on fields\n");
+    return EXIT_FAILURE;
+  }
+  if (delim_arg) {
+    if (delim_arg[0] && delim_arg[1]) {
+      fprintf(stderr, "cut: the delimiter must be a single character\n");
+      return EXIT_FAILURE;
     }
+    delim = delim_arg[0]; // -d '' is the NUL byte
   }
+  if (parse_list(list, fields ? "fields" : "byte/character positions") < 0)
+    return EXIT_FAILURE;
+  // The fields are joined with the input delimiter by default
+  if (fields && out_delim == NULL) {
+    out_delim = (const char *)&delim;
+    out_delim_len = 1;
+  } else if (out_delim) {
+    out_delim_len = strlen(out_delim);
+  }
+  join = fields && out_delim_len == 1 && out_delim[0] == (char)delim;
+  select_kernel();
+
+  mb_writer_init(&w, STDOUT_FILENO);
+  if (nfiles == 0)
+    argv[nfiles++] = "-";
+  for (int i = 0; i < nfiles; i++) {
+    int is_stdin = strcmp(argv[i], "-") == 0;
+    int fd = is_stdin ? STDIN_FILENO : open(argv[i], O_RDONLY);
 
-  free(fields);
-  return EXIT_SUCCESS;
+    if (fd < 0 || cut_fd(fd, &w) < 0) {
+      fprintf(stderr, "cut: %s: %s\n", is_stdin ? "-" : argv[i],
+              strerror(errno));
+      ret = EXIT_FAILURE;
+    }
+    if (fd >= 0 && !is_stdin)
+      close(fd);
+  }
+  free(ranges);
+  if (mb_writer_free(&w) < 0 || w.error) {
+    errno = w.error;
+    perror("cut: write error");
+    return EXIT_FAILURE;
+  }
+  return ret;
 }
@@ -20,12 +20,20 @@
  */
 
 #include "minibox.h"
+#include "libmb.h"
 
 #define DEFAULT_TAB_WIDTH 8
 
+// Output a run of `count` spaces as tabs followed by the remaining spaces
+static void put_space_run(mb_writer *w, int count, int tab_width) {
+  for (int i = 0; i < count / tab_width; i++)
+    mb_putc(w, '\t');
+  for (int i = 0; i < count % tab_width; i++)
+    mb_putc(w, ' ');
+}
+
 int expand(int argc, char *argv[]) {
-  FILE *input = stdin;
-  FILE *output = stdout;
+  int input = STDIN_FILENO;
   int tab_width = DEFAULT_TAB_WIDTH;
   bool replace_tabs = false;
   bool replace_all_spaces = false;
@@ -39,44 +47,59 @@ int expand(int argc, char *argv[]) {
     } else if (argv[i][0] == '-' && argv[i][1] == 'a') {
       replace_all_spaces = true;
     } else {
-      input = fopen(argv[i], "r");
-      if (!input) {
+      input = open(argv[i], O_RDONLY);
+      if (input < 0) {
         perror("Error opening input file");
         return 1;
       }
     }
   }
 
-  int c;
+  if (tab_width < 1)
+    tab_width = DEFAULT_TAB_WIDTH;
+
+  mb_reader r;
+  mb_writer w;
+  char *p;
+  size_t len;
   int column = 0;
-  while ((c = fgetc(input)) != EOF) {
-    if (replace_tabs && c == '\t') {
-      int spaces = tab_width - (column % tab_width);
-      for (int i = 0; i < spaces; i++)
-        fputc(' ', output);
-      column += spaces;
-    } else if (replace_all_spaces && c == ' ') {
-      int space_count = 1;
-      while ((c = fgetc(input)) == ' ')
+  int space_count = 0; // Spaces of a run still waiting for its end (-a)
+
+  mb_reader_init(&r, input);
+  mb_writer_init(&w, STDOUT_FILENO);
+  while ((p = mb_next_block(&r, &len)) != NULL) {
+    for (size_t i = 0; i < len; i++) {
+      char c = p[i];
+
+      if (replace_all_spaces && c == ' ') {
         space_count++;
-      fseek(input, -1, SEEK_CUR); // Rewind one character
-      int tabs = space_count / tab_width;
-      int spaces = space_count % tab_width;
-      for (int i = 0; i < tabs; i++)
-        fputc('\t', output);
-      for (int i = 0; i < spaces; i++)
-        fputc(' ', output);
-      column = (column + space_count) % tab_width;
-    } else {
-      if (c == '\n')
-        column = 0;
-      else
-        column++;
-      fputc(c, output);
+        continue;
+      }
+      if (space_count > 0) {
+        put_space_run(&w, space_count, tab_width);
+        column = (column + space_count) % tab_width;
+        space_count = 0;
+      }
+
+      if (replace_tabs && c == '\t') {
+        int spaces = tab_width - (column % tab_width);
+        for (int j = 0; j < spaces; j++)
+          mb_putc(&w, ' ');
+        column += spaces;
+      } else {
+        if (c == '\n')
+          column = 0;
+        else
+          column++;
+        mb_putc(&w, c);
+      }
     }
   }
+  put_space_run(&w, space_count, tab_width);
 
-  if (input != stdin)
-    fclose(input);
+  mb_writer_free(&w);
+  mb_reader_free(&r);
+  if (input != STDIN_FILENO)
+    close(input);
   return 0;
 }
@@ -20,12 +20,12 @@
  */
 
 #include "minibox.h"
+#include "libmb.h"
 
 #define DEFAULT_WIDTH 80
 
 int fold(int argc, char *argv[]) {
-  FILE *input = stdin;
-  FILE *output = stdout;
+  int input = STDIN_FILENO;
   int width = DEFAULT_WIDTH;
   bool break_at_spaces = false;
   bool break_at_bytes = false;
@@ -39,57 +39,75 @@ int fold(int argc, char *argv[]) {
     } else if (argv[i][0] == '-' && argv[i][1] == 'b') {
       break_at_bytes = true;
     } else {
-      input = fopen(argv[i], "r");
-      if (!input) {
+      input = open(argv[i], O_RDONLY);
+      if (input < 0) {
         perror("Error opening input file");
         return 1;
       }
     }
   }
 
-  int c, column = 0, last_space = -1;
+  if (width < 1)
+    width = 1;
 
-  while ((c = fgetc(input)) != EOF) {
-    if (break_at_bytes) {
-      if (column >= width) {
-        fputc('\n', output);
+  // The current output line is kept until it is complete so that -s can
+  // break it at its last space
+  char *line = malloc(width);
+  if (!line) {
+    perror("malloc");
+    return 1;
+  }
+
+  mb_reader r;
+  mb_writer w;
+  char *p;
+  size_t len;
+  int column = 0, last_space = -1;
+
+  mb_reader_init(&r, input);
+  mb_writer_init(&w, STDOUT_FILENO);
+  while ((p = mb_next_block(&r, &len)) != NULL) {
+    for (size_t i = 0; i < len; i++) {
+      char c = p[i];
+
+      if (c == '\n') {
+        mb_write(&w, line, column);
+        mb_putc(&w, '\n');
         column = 0;
         last_space = -1;
+        continue;
       }
-    } else {
+
       if (column >= width) {
-        if (break_at_spaces && last_space != -1) {
-          fseek(input, last_space, SEEK_SET);
-          fputc('\n', output);
-          column = 0;
-          last_space = -1;
+        if (break_at_spaces && !break_at_bytes && last_space != -1) {
+          // Break after the last space and carry the rest over
+          mb_write(&w, line, last_space + 1);
+          mb_putc(&w, '\n');
+          column -= last_space + 1;
+          memmove(line, line + last_space + 1, column);
         } else {
-          fputc('\n', output);
+          mb_write(&w, line, column);
+          mb_putc(&w, '\n');
           column = 0;
         }
+        last_space = -1;
+        for (int j = 0; j < column; j++)
+          if (line[j] == ' ')
+            last_space = j;
       }
-    }
 
-    if (c == ' ') {
-      last_space = ftell(input);
+      if (c == ' ')
+        last_space = column;
+      line[column++] = c;
     }
-
-    fputc(c, output);
-    column++;
-
-    if (c == '\n') {
-      column = 0;
-      last_space = -1;
-    }
-  }
-
-  if (column > 0 && !break_at_bytes && break_at_spaces && last_space != -1) {
-    fseek(input, last_space, SEEK_SET);
-    fputc('\n', output);
   }
+  mb_write(&w, line, column);
 
-  if (input != stdin) {
-    fclose(input);
+  mb_writer_free(&w);
+  mb_reader_free(&r);
+  free(line);
+  if (input != STDIN_FILENO) {
+    close(input);
   }
 
   return 0;
@@ -20,30 +20,1269 @@
  */
 
 #include "minibox.h"
+#include "libmb.h"
+
+#include <ctype.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define MAX_THREADS 64
+#define MMAP_MIN (1024 * 1024) // Smaller files are read, see map_file()
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define GREP_X86 1
+#endif
+
+// A fixed string and what its search needs. Ignoring the case the pattern is
+// in lower case and the text is folded as it is compared.
+typedef struct {
+  const unsigned char *pat;
+  size_t len;
+  size_t rare1, rare2;  // Offsets of the two rarest bytes of the pattern
+  unsigned char fold1, fold2; // 0x20 if the rare byte is a letter, ignoring
+                              // the case, so byte | fold matches both cases
+  int fold;
+  size_t shift[256];    // Horspool bad character shifts
+} literal;
+
+// Aho-Corasick automaton for searching many fixed strings in one pass. States
+// are numbered in breadth first order, so the shallow ones where the search
+// spends most of its time sit next to each other. Those first ndense states
+// get a full transition row indexed by byte class (failure links already
+// resolved), the deeper ones only a short run of edges scanned linearly
+// (bytes and targets are kept apart so the scan only touches the bytes) and
+// a failure link followed on a miss. Targets of states where a pattern ends
+// carry AC_MATCH, so finding a match costs no extra load.
+typedef struct {
+  uint32_t root[256];      // Root transitions by byte, to skip ahead
+  unsigned char cls[256];  // Byte classes: one per byte used by the patterns,
+                           // all the other bytes share class 0
+  uint32_t nclasses, ndense;
+  int fold;                // Patterns are in lower case, the text is folded
+  uint32_t *dense;         // ndense rows of nclasses transitions
+  uint32_t *fail;          // Longest proper suffix that is also a state
+  uint32_t *edges;         // Edges of state s are [edges[s], edges[s + 1])
+  unsigned char *edge_byte;
+  uint32_t *edge_to;
+} aho_corasick;
+
+#define AC_MATCH 0x80000000u
+#define AC_DENSE_BYTES (2 * 1024 * 1024) // Budget for the dense rows
+
+typedef struct {
+  const char *str;
+  size_t len;
+} pattern;
+
+static pattern *patterns;
+static size_t npatterns;
+static literal lit;
+static aho_corasick *ac; // Only built for more than one pattern
+static char *regex_src;  // -E with a pattern that isn't a plain string, all
+static size_t regex_len; // the patterns joined for mb_regex_compile()
+static literal must;     // What every match of the regex contains, may be empty
+static int multiple_files, list_files, count_only, quiet, ignore_case;
+static int text;         // -a, binary files are searched like text
+static int context;      // -A, -B or -C was given, groups get separated
+static long before = -1, after = -1;
+static int recursive;    // 1 for -r, 2 for -R which follows all symlinks
+
+// How common a byte is in text and logs, higher is more common. Bytes not
+// listed (upper case letters, most punctuation, control and 8 bit bytes) are
+// treated as rare.
+static int byte_rank(unsigned char c) {
+  static const char common[] = " etaoinsrhldcumfpgwybvk0123456789-.,:/=\"_";
+  const char *p = c ? memchr(common, c, sizeof(common) - 1) : NULL;
+
+  if (p)
+    return 255 - (p - common);
+  return c < 128 && c >= ' ' ? 100 : 50;
+}
+
+// Whether the n bytes at s are the lower case pattern p, ignoring their case
+static int equal_fold(const unsigned char *s, const unsigned char *p,
+                      size_t n) {
+  for (size_t i = 0; i < n; i++) {
+    if (mb_lower(s[i]) != p[i])
+      return 0;
+  }
+  return 1;
+}
+
+static int literal_equal(const literal *l, const char *s) {
+  if (l->fold)
+    return equal_fold((const unsigned char *)s, l->pat, l->len);
+  return memcmp(s, l->pat, l->len) == 0;
+}
+
+// With fold the pattern has to be in lower case already
+static void literal_init(literal *l, const char *pattern, size_t len,
+                         int fold) {
+  l->pat = (const unsigned char *)pattern;
+  l->len = len;
+  l->fold = fold;
+  l->rare1 = l->rare2 = 0;
+
+  // The candidate filter looks for the two rarest bytes at their offsets
+  for (size_t i = 1; i < l->len; i++) {
+    if (byte_rank(l->pat[i]) < byte_rank(l->pat[l->rare1]))
+      l->rare1 = i;
+  }
+  l->rare2 = l->rare1 == 0 && l->len > 1 ? 1 : 0;
+  for (size_t i = 0; i < l->len; i++) {
+    if (i != l->rare1 && byte_rank(l->pat[i]) < byte_rank(l->pat[l->rare2]))
+      l->rare2 = i;
+  }
+
+  l->fold1 = fold && islower(l->pat[l->rare1]) ? 0x20 : 0;
+  l->fold2 = fold && islower(l->pat[l->rare2]) ? 0x20 : 0;
+
+  for (int c = 0; c < 256; c++)
+    l->shift[c] = l->len;
+  for (size_t i = 0; i + 1 < l->len; i++) {
+    l->shift[l->pat[i]] = l->len - 1 - i;
+    if (fold && islower(l->pat[i]))
+      l->shift[toupper(l->pat[i])] = l->len - 1 - i;
+  }
+}
+
+// Horspool search, used without vector instructions and for the tails
+static const char *horspool(const literal *l, const char *s, const char *end) {
+  const unsigned char *p = (const unsigned char *)s;
+  const unsigned char *e = (const unsigned char *)end;
+  size_t last = l->len - 1;
+
+  while ((size_t)(e - p) >= l->len) {
+    unsigned char c = p[last];
+
+    if ((l->fold ? mb_lower(c) : c) == l->pat[last] &&
+        literal_equal(l, (const char *)p))
+      return (const char *)p;
+    p += l->shift[c];
+  }
+  return NULL;
+}
+
+#ifdef GREP_X86
+// Both vector searches compare a whole vector of positions at once against
+// the two rare bytes at their offsets, and only the positions where both
+// are found get a comparison of the whole pattern. Ignoring the case, a
+// letter is set to lower case with an or before it is compared, which
+// finds both of its cases in one go.
+__attribute__((target("sse2"))) static const char *
+search_sse2(const literal *l, const char *s, const char *end) {
+  size_t n = end - s, far = l->rare1 > l->rare2 ? l->rare1 : l->rare2, i = 0;
+  const __m128i b1 = _mm_set1_epi8(l->pat[l->rare1]);
+  const __m128i b2 = _mm_set1_epi8(l->pat[l->rare2]);
+  const __m128i f1 = _mm_set1_epi8(l->fold1), f2 = _mm_set1_epi8(l->fold2);
+
+  for (; i + far + 16 <= n; i += 16) {
+    __m128i v1 = _mm_loadu_si128((const __m128i *)(s + i + l->rare1));
+    __m128i v2 = _mm_loadu_si128((const __m128i *)(s + i + l->rare2));
+    unsigned m = _mm_movemask_epi8(
+        _mm_and_si128(_mm_cmpeq_epi8(_mm_or_si128(v1, f1), b1),
+                      _mm_cmpeq_epi8(_mm_or_si128(v2, f2), b2)));
+
+    while (m) {
+      size_t at = i + __builtin_ctz(m);
+      if (at + l->len <= n && literal_equal(l, s + at))
+        return s + at;
+      m &= m - 1;
+    }
+  }
+  return horspool(l, s + i, end);
+}
+
+__attribute__((target("avx2"))) static const char *
+search_avx2(const literal *l, const char *s, const char *end) {
+  size_t n = end - s, far = l->rare1 > l->rare2 ? l->rare1 : l->rare2, i = 0;
+  const __m256i b1 = _mm256_set1_epi8(l->pat[l->rare1]);
+  const __m256i b2 = _mm256_set1_epi8(l->pat[l->rare2]);
+  const __m256i f1 = _mm256_set1_epi8(l->fold1);
+  const __m256i f2 = _mm256_set1_epi8(l->fold2);
+
+  for (; i + far + 32 <= n; i += 32) {
+    __m256i v1 = _mm256_loadu_si256((const __m256i *)(s + i + l->rare1));
+    __m256i v2 = _mm256_loadu_si256((const __m256i *)(s + i + l->rare2));
+    unsigned m = _mm256_movemask_epi8(
+        _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_or_si256(v1, f1), b1),
+                         _mm256_cmpeq_epi8(_mm256_or_si256(v2, f2), b2)));
+
+    while (m) {
+      size_t at = i + __builtin_ctz(m);
+      if (at + l->len <= n && literal_equal(l, s + at))
+        return s + at;
+      m &= m - 1;
+    }
+  }
+  return horspool(l, s + i, end);
+}
+#endif
+
+// Find the pattern in [s, end), returns where it starts or NULL
+static const char *find_literal(const literal *l, const char *s,
+                                const char *end) {
+  if (l->len == 0)
+    return s;
+  if (l->len == 1 && !l->fold1)
+    return memchr(s, l->pat[0], end - s);
+#ifdef GREP_X86
+  if (mb_simd_level() == MB_SIMD_AVX2)
+    return search_avx2(l, s, end);
+  if (mb_simd_level() == MB_SIMD_SSE2)
+    return search_sse2(l, s, end);
+#endif
+  return horspool(l, s, end);
+}
+
+// Trie the automaton is built from, children are kept in sibling lists
+typedef struct {
+  uint32_t child, sibling, fail;
+  unsigned char byte, end;
+} trie_node;
+
+static uint32_t trie_child(const aho_corasick *a, const trie_node *t,
+                           uint32_t node, unsigned char c) {
+  if (node == 0)
+    return a->root[c];
+  for (uint32_t k = t[node].child; k; k = t[k].sibling) {
+    if (t[k].byte == c)
+      return k;
+  }
+  return 0;
+}
+
+// With fold the patterns have to be in lower case already
+static aho_corasick *ac_build(const pattern *pats, size_t count, int fold) {
+  aho_corasick *a = xzalloc(sizeof(*a));
+  trie_node *t;
+  uint32_t *order, *renumber, n = 1, head = 1, tail = 1, nedges = 0;
+  size_t total = 1;
+
+  for (size_t i = 0; i < count; i++)
+    total += pats[i].len;
+  t = xzalloc(total * sizeof(*t));
+
+  // The root children go in a->root while building, renumbered at the end
+  for (size_t i = 0; i < count; i++) {
+    uint32_t node = 0;
+
+    // A pattern whose prefix is already a pattern can never match first
+    for (size_t j = 0; j < pats[i].len && !t[node].end; j++) {
+      unsigned char c = pats[i].str[j];
+      uint32_t next = trie_child(a, t, node, c);
+
+      if (next == 0) {
+        next = n++;
+        t[next].byte = c;
+        if (node == 0) {
+          a->root[c] = next;
+        } else {
+          t[next].sibling = t[node].child;
+          t[node].child = next;
+        }
+      }
+      if (a->cls[c] == 0)
+        a->cls[c] = ++a->nclasses;
+      node = next;
+    }
+    t[node].end = 1;
+  }
+  a->nclasses++;
+
+  // Breadth first walk: failure links need the ones of shallower states, and
+  // the order is also the final numbering
+  order = xmalloc(n * sizeof(*order));
+  renumber = xmalloc(n * sizeof(*renumber));
+  order[0] = 0;
+  for (int c = 0; c < 256; c++) {
+    if (a->root[c])
+      order[tail++] = a->root[c];
+  }
+  while (head < tail) {
+    uint32_t u = order[head++];
+
+    for (uint32_t v = t[u].child; v; v = t[v].sibling) {
+      uint32_t f = t[u].fail, x;
+
+      while ((x = trie_child(a, t, f, t[v].byte)) == 0 && f != 0)
+        f = t[f].fail;
+      t[v].fail = x;
+      t[v].end |= t[x].end;
+      order[tail++] = v;
+    }
+  }
+  for (uint32_t i = 0; i < n; i++)
+    renumber[order[i]] = i | (t[order[i]].end ? AC_MATCH : 0);
+
+  a->ndense = AC_DENSE_BYTES / (a->nclasses * sizeof(uint32_t));
+  if (a->ndense > n)
+    a->ndense = n;
+  a->dense = xmalloc((size_t)a->ndense * a->nclasses * sizeof(*a->dense));
+  a->fail = xmalloc(n * sizeof(*a->fail));
+  a->edges = xmalloc((n + 1) * sizeof(*a->edges));
+  a->edge_byte = xmalloc(n);
+  a->edge_to = xmalloc(n * sizeof(*a->edge_to));
+  for (uint32_t i = 0; i < n; i++) {
+    uint32_t old = order[i], *row = a->dense + (size_t)i * a->nclasses;
+
+    a->fail[i] = renumber[t[old].fail] & ~AC_MATCH;
+    a->edges[i] = nedges;
+    for (uint32_t k = t[old].child; k; k = t[k].sibling) {
+      a->edge_byte[nedges] = t[k].byte;
+      a->edge_to[nedges++] = renumber[k];
+    }
+    if (i >= a->ndense)
+      continue;
+
+    // A row starts as the one of the failure state, which is shallower and
+    // so already done, then the state's own edges are put over it. The root
+    // keeps its children in a->root only.
+    if (i == 0) {
+      memset(row, 0, a->nclasses * sizeof(*row));
+      for (int c = 0; c < 256; c++) {
+        if (a->root[c])
+          row[a->cls[c]] = renumber[a->root[c]];
+      }
+      continue;
+    }
+    memcpy(row, a->dense + (size_t)a->fail[i] * a->nclasses,
+           a->nclasses * sizeof(*row));
+    for (uint32_t k = t[old].child; k; k = t[k].sibling)
+      row[a->cls[t[k].byte]] = renumber[k];
+  }
+  a->edges[n] = nedges;
+  for (int c = 0; c < 256; c++)
+    a->root[c] = a->root[c] ? renumber[a->root[c]] : 0;
+
+  // Ignoring the case upper case letters start and continue the same way,
+  // only the edges of the deep states need the text folded
+  a->fold = fold;
+  for (int c = 'A'; fold && c <= 'Z'; c++) {
+    a->root[c] = a->root[mb_lower(c)];
+    a->cls[c] = a->cls[mb_lower(c)];
+  }
+
+  free(t);
+  free(order);
+  free(renumber);
+  return a;
+}
+
+// Returns a pointer to the last byte of the first match in [s, end) or NULL.
+// Patterns never contain a newline, so the state falls back to the root at
+// every line end by itself.
+static const char *ac_find(const aho_corasick *a, const char *s,
+                           const char *end) {
+  const unsigned char *p = (const unsigned char *)s;
+  const unsigned char *e = (const unsigned char *)end;
+  uint32_t state = 0;
+
+  while (p < e) {
+    unsigned char c;
+
+    if (state == 0) {
+      // Skip the bytes no pattern starts with
+      while (p < e && a->root[*p] == 0)
+        p++;
+      if (p == e)
+        break;
+      state = a->root[*p++];
+    } else {
+      c = *p++;
+      for (;;) {
+        uint32_t k, stop;
+
+        if (state < a->ndense) {
+          state = a->dense[(size_t)state * a->nclasses + a->cls[c]];
+          break;
+        }
+        if (a->fold)
+          c = mb_lower(c);
+        k = a->edges[state];
+        stop = a->edges[state + 1];
+        while (k < stop && a->edge_byte[k] != c)
+          k++;
+        if (k < stop) {
+          state = a->edge_to[k];
+          break;
+        }
+        state = a->fail[state];
+      }
+    }
+    if (state & AC_MATCH)
+      return (const char *)p - 1;
+  }
+  return NULL;
+}
+
+// An open directory whose entries are still being searched, they are opened
+// relative to it. It goes away with the last of them.
+typedef struct grep_dir {
+  int fd;
+  dev_t dev;
+  ino_t ino;
+  struct grep_dir *parent; // Kept open for the -R loop check
+  int refs;
+} grep_dir;
+
+// A file or directory waiting to be searched
+typedef struct {
+  grep_dir *dir; // NULL for the command line operands
+  char *path;    // What gets printed, the name is its last component
+  size_t name;   // Offset of the name in path
+  int type;      // DT_* of the entry, DT_UNKNOWN if readdir didn't say
+} grep_item;
+
+// Everything a search thread owns: its end of the work stealing deque, its
+// regex (the lazy DFA is modified while searching) and its output buffer
+typedef struct {
+  pthread_mutex_t lock;
+  grep_item *items; // The owner works at the tail, thieves take the head
+  size_t head, tail, cap;
+  int id;
+
+  mb_regex *re;
+  size_t candidates, skipped; // Prefilter statistics, see find_regex()
+  int no_must;
+
+  mb_reader r; // Reused for every file
+  char *map;   // The file when it is mapped instead of read
+  size_t map_size, map_left;
+  mb_writer w;
+  int locked;  // Holds out_lock until the current file is done
+
+  // Context of the current file. Lines are never copied, except the before
+  // context left at the end of a chunk: it goes to the spill buffer since
+  // the next refill moves the data of the reader.
+  long after_left; // After context lines still to print
+  int printed;     // Lines of this file were printed
+  int gap;         // Lines were left out since the last printed one
+  char *spill;
+  size_t spill_len, spill_cap;
+  long spill_lines;
+
+  long matches;
+  int error;
+} grep_worker;
+
+static grep_worker *workers;
+static int num_workers;
+
+static pthread_mutex_t out_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t work_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER;
+static long pending; // Items pushed and not finished, atomic
+static long queued;  // Items sitting in a deque, atomic
+static int idle;     // Threads waiting for work, under work_lock
+static int quit;     // -q found a match, atomic
+static long groups;  // Context groups printed by all files, under out_lock
+
+// Run the regex only on the lines containing its required literal. When
+// nearly every line has it the search is only overhead and is dropped after
+// a while.
+static const char *find_regex(grep_worker *gw, const char *s,
+                              const char *end) {
+  const char *m;
+
+  if (must.len == 0 || gw->no_must)
+    return mb_regex_search(gw->re, s, end);
+  while (s < end && (m = find_literal(&must, s, end)) != NULL) {
+    const char *start = m, *stop = memchr(m, '\n', end - m);
+
+    while (start > s && start[-1] != '\n')
+      start--;
+    stop = stop ? stop + 1 : end;
+    gw->skipped += start - s;
+    if (++gw->candidates == 4096 && gw->skipped < gw->candidates * 256) {
+      gw->no_must = 1;
+      return mb_regex_search(gw->re, start, end);
+    }
+    if (mb_regex_search(gw->re, start, stop))
+      return start;
+    s = stop;
+  }
+  return NULL;
+}
+
+// Returns a pointer into the first matching line of [s, end) or NULL
+static const char *find_match(grep_worker *gw, const char *s,
+                              const char *end) {
+  if (gw->re)
+    return find_regex(gw, s, end);
+  if (ac)
+    return ac_find(ac, s, end);
+  if (npatterns == 0)
+    return NULL;
+  return find_literal(&lit, s, end);
+}
+
+// The output of a file goes out in one piece: once it no longer fits in the
+// buffer the output lock is taken and held until the file is done
+static void out_write(grep_worker *gw, const void *data, size_t len) {
+  if (!gw->locked && gw->w.len + len > MB_BUFSIZ) {
+    pthread_mutex_lock(&out_lock);
+    gw->locked = 1;
+  }
+  mb_write(&gw->w, data, len);
+}
+
+static void out_done(grep_worker *gw) {
+  if (!gw->locked && gw->w.len > 0) {
+    pthread_mutex_lock(&out_lock);
+    gw->locked = 1;
+  }
+  mb_flush(&gw->w);
+  if (gw->locked) {
+    pthread_mutex_unlock(&out_lock);
+    gw->locked = 0;
+  }
+}
+
+static void out_name(grep_worker *gw, const char *name, int sep) {
+  out_write(gw, name, strlen(name));
+  out_write(gw, &(char){sep}, 1);
+}
+
+// Move up to *n complete lines forward from s, *n is set to the number of
+// lines passed
+static const char *lines_forward(const char *s, const char *end, long *n) {
+  long k = 0;
+
+  while (k < *n && s < end) {
+    const char *nl = memchr(s, '\n', end - s);
+
+    s = nl ? nl + 1 : end;
+    k++;
+  }
+  *n = k;
+  return s;
+}
+
+// Move up to *n lines back from the line start s, not before lo
+static const char *lines_back(const char *lo, const char *s, long *n) {
+  long k = 0;
+
+  while (k < *n && s > lo) {
+    s--;
+    while (s > lo && s[-1] != '\n')
+      s--;
+    k++;
+  }
+  *n = k;
+  return s;
+}
+
+// Separate what is printed next from the last group of lines printed
+static void group_start(grep_worker *gw) {
+  if (context && !gw->printed) {
+    // Whether the first group needs a separator depends on the files
+    // printed before, so the output is taken until this file is done
+    if (!gw->locked) {
+      pthread_mutex_lock(&out_lock);
+      gw->locked = 1;
+    }
+    if (groups++ > 0)
+      out_write(gw, "--\n", 3);
+  } else if (context && gw->gap) {
+    out_write(gw, "--\n", 3);
+  }
+  gw->printed = 1;
+  gw->gap = 0;
+}
+
+// Print the complete lines of [s, end) with sep after the file name
+static void print_lines(grep_worker *gw, const char *name, int sep,
+                        const char *s, const char *end) {
+  if (s == end)
+    return;
+  group_start(gw);
+  if (!multiple_files) {
+    out_write(gw, s, end - s);
+  } else {
+    while (s < end) {
+      const char *nl = memchr(s, '\n', end - s), *stop = nl ? nl + 1 : end;
+
+      out_name(gw, name, sep);
+      out_write(gw, s, stop - s);
+      s = stop;
+    }
+  }
+  if (end[-1] != '\n')
+    out_write(gw, "\n", 1);
+}
+
+// Print the after context of the last match and the before context of the
+// match at the line start, p is the first line not printed or left out yet.
+// The spill holds the lines before the chunk start and is used up here.
+static void print_context(grep_worker *gw, const char *name, const char *chunk,
+                          const char *p, const char *start) {
+  long n = gw->after_left, want;
+  const char *b, *q = lines_forward(p, start, &n);
+
+  gw->after_left -= n;
+  print_lines(gw, name, '-', p, q);
+  p = q;
+
+  n = before;
+  b = lines_back(p, start, &n);
+  if (b > p || (p > chunk && gw->spill_lines > 0)) {
+    gw->gap = 1;
+  } else if (gw->spill_lines > 0) {
+    want = before - n;
+    q = gw->spill + gw->spill_len;
+    p = lines_back(gw->spill, q, &want);
+    if (p > gw->spill || want == 0)
+      gw->gap = 1;
+    print_lines(gw, name, '-', p, q);
+  }
+  gw->spill_len = gw->spill_lines = 0;
+  print_lines(gw, name, '-', b, start);
+}
+
+// After the last match of a chunk: print what is left of the after context
+// and keep the lines that can be before context of a match in the next one
+static void chunk_context(grep_worker *gw, const char *name, const char *chunk,
+                          const char *p, const char *end) {
+  long n = gw->after_left, want;
+  const char *b, *q = lines_forward(p, end, &n);
+
+  gw->after_left -= n;
+  print_lines(gw, name, '-', p, q);
+  p = q;
+  if (p == end)
+    return;
+
+  n = before;
+  b = lines_back(p, end, &n);
+  if (b > p)
+    gw->gap = 1;
+  // Lines of the spill are still needed if this chunk has too few
+  want = p == chunk ? before - n : 0;
+  q = gw->spill + gw->spill_len;
+  p = lines_back(gw->spill, q, &want);
+  if (p > gw->spill)
+    gw->gap = 1;
+  memmove(gw->spill, p, q - p);
+  gw->spill_len = q - p;
+  gw->spill_lines = want + n;
+
+  if (gw->spill_len + (end - b) > gw->spill_cap) {
+    gw->spill_cap = gw->spill_len + (end - b);
+    gw->spill = xrealloc(gw->spill, gw->spill_cap);
+  }
+  memcpy(gw->spill + gw->spill_len, b, end - b);
+  gw->spill_len += end - b;
+}
+
+// Big regular files are mapped and searched in place as one chunk, which
+// saves copying them to the reader's buffer. Below MMAP_MIN setting up and
+// tearing down the mapping costs more than the copy.
+static void map_file(grep_worker *gw, int fd) {
+  struct stat st;
+  char *map;
+
+  gw->map = NULL;
+  if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size < MMAP_MIN ||
+      (uint64_t)st.st_size > SIZE_MAX ||
+      lseek(fd, 0, SEEK_CUR) != 0)
+    return;
+  map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (map == MAP_FAILED)
+    return;
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  gw->map = map;
+  gw->map_size = gw->map_left = st.st_size;
+}
+
+// The next chunk of complete lines, the whole file at once when it is mapped
+static char *next_chunk(grep_worker *gw, size_t *len) {
+  if (gw->map == NULL)
+    return mb_next_lines(&gw->r, len);
+  *len = gw->map_left;
+  gw->map_left = 0;
+  return *len ? gw->map : NULL;
+}
+
+// Search a whole chunk of lines at once and only look for the boundaries of
+// the lines that matched. -l and -q stop at the first match. A file with a
+// NUL in its first block is binary: instead of its lines only a message
+// says that it matched.
+static void grep_fd(grep_worker *gw, int fd, const char *name) {
+  mb_reader *r = &gw->r;
+  char *chunk;
+  size_t len;
+  long count = 0;
+  int show_context = context && !count_only, binary = -1;
+
+  gw->after_left = gw->printed = gw->gap = 0;
+  gw->spill_len = gw->spill_lines = 0;
+  mb_reader_reset(r, fd);
+  map_file(gw, fd);
+  while (!__atomic_load_n(&quit, __ATOMIC_RELAXED) &&
+         (chunk = next_chunk(gw, &len)) != NULL) {
+    const char *p = chunk, *end = chunk + len, *m;
+
+    if (binary < 0) {
+      size_t head = len < MB_BUFSIZ ? len : MB_BUFSIZ;
+
+      binary = !text && memchr(chunk, '\0', head) != NULL;
+    }
+    while (p < end && (m = find_match(gw, p, end)) != NULL) {
+      const char *start = m, *stop = memchr(m, '\n', end - m);
+
+      count++;
+      if (quiet) {
+        __atomic_store_n(&quit, 1, __ATOMIC_RELAXED);
+        goto done;
+      }
+      if (list_files)
+        goto done;
+      if (binary && !count_only) {
+        // A note rather than output, so not a line of it
+        fprintf(stderr, "grep: %s: binary file matches\n", name);
+        goto done;
+      }
+
+      while (start > p && start[-1] != '\n')
+        start--;
+      stop = stop ? stop + 1 : end;
+      if (show_context) {
+        print_context(gw, name, chunk, p, start);
+        gw->after_left = after;
+      }
+      if (!count_only)
+        print_lines(gw, name, ':', start, stop);
+      p = stop;
+    }
+    if (show_context)
+      chunk_context(gw, name, chunk, p, end);
+  }
+
+done:
+  if (gw->map)
+    munmap(gw->map, gw->map_size);
+  if (r->error) {
+    errno = r->error;
+    perror(name);
+    gw->error = 1;
+  }
+  if (list_files && count > 0) {
+    out_name(gw, name, '\n');
+  } else if (count_only && !list_files && !quiet) {
+    char buf[32];
+
+    if (multiple_files)
+      out_name(gw, name, ':');
+    out_write(gw, buf, snprintf(buf, sizeof(buf), "%ld\n", count));
+  }
+  out_done(gw);
+  gw->matches += count;
+}
+
+static void dir_release(grep_dir *d) {
+  while (d && __atomic_sub_fetch(&d->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+    grep_dir *parent = d->parent;
+
+    close(d->fd);
+    free(d);
+    d = parent;
+  }
+}
+
+// Queue an item on the deque of gw, growing it if needed
+static void push_item(grep_worker *gw, const grep_item *it) {
+  pthread_mutex_lock(&gw->lock);
+  if (gw->tail == gw->cap) {
+    if (gw->head > 0) {
+      memmove(gw->items, gw->items + gw->head,
+              (gw->tail - gw->head) * sizeof(*gw->items));
+      gw->tail -= gw->head;
+      gw->head = 0;
+    } else {
+      gw->cap = gw->cap ? gw->cap * 2 : 64;
+      gw->items = xrealloc(gw->items, gw->cap * sizeof(*gw->items));
+    }
+  }
+  gw->items[gw->tail++] = *it;
+  pthread_mutex_unlock(&gw->lock);
+  __atomic_add_fetch(&pending, 1, __ATOMIC_ACQ_REL);
+  __atomic_add_fetch(&queued, 1, __ATOMIC_ACQ_REL);
+}
+
+// Wake the threads waiting for work or for the end
+static void wake_idle(void) {
+  pthread_mutex_lock(&work_lock);
+  if (idle > 0)
+    pthread_cond_broadcast(&work_cond);
+  pthread_mutex_unlock(&work_lock);
+}
+
+// Take from the own deque last in first out, which walks the tree depth
+// first, and from the others first in first out, which takes the biggest
+// pieces of work (the directories closest to the top)
+static int take_item(grep_worker *gw, grep_item *it) {
+  for (int k = 0; k < num_workers; k++) {
+    grep_worker *from = &workers[(gw->id + k) % num_workers];
+    int found = 0;
+
+    pthread_mutex_lock(&from->lock);
+    if (from->tail > from->head) {
+      *it = from == gw ? from->items[--from->tail] : from->items[from->head++];
+      found = 1;
+    }
+    pthread_mutex_unlock(&from->lock);
+    if (found) {
+      __atomic_sub_fetch(&queued, 1, __ATOMIC_ACQ_REL);
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Name of an entry of a directory, joined to the path of the directory
+static char *join_path(const char *dir, const char *name) {
+  size_t len = strlen(dir);
+  char *path = xmalloc(len + strlen(name) + 2);
+
+  memcpy(path, dir, len);
+  if (len > 0 && dir[len - 1] != '/')
+    path[len++] = '/';
+  strcpy(path + len, name);
+  return path;
+}
+
+// Read a directory and queue its entries, in reverse so that they come back
+// out of the deque in the order readdir gave them
+static void expand_dir(grep_worker *gw, grep_dir *parent, int fd,
+                       const char *path) {
+  grep_dir *d = xzalloc(sizeof(*d));
+  grep_item *list = NULL;
+  size_t n = 0, cap = 0;
+  struct dirent *e;
+  struct stat st;
+  DIR *dp;
+
+  if (fstat(fd, &st) < 0 || (dp = fdopendir(dup(fd))) == NULL) {
+    perror(path);
+    gw->error = 1;
+    close(fd);
+    free(d);
+    return;
+  }
+  d->fd = fd;
+  d->dev = st.st_dev;
+  d->ino = st.st_ino;
+  d->refs = 1;
+  d->parent = parent;
+  if (parent)
+    __atomic_add_fetch(&parent->refs, 1, __ATOMIC_ACQ_REL);
+
+  // Following symbolic links can lead back to a directory being searched
+  for (grep_dir *a = parent; a; a = a->parent) {
+    if (a->dev == d->dev && a->ino == d->ino) {
+      fprintf(stderr, "grep: %s: warning: recursive directory loop\n", path);
+      closedir(dp);
+      dir_release(d);
+      return;
+    }
+  }
+
+  while ((e = readdir(dp)) != NULL) {
+    if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+      continue;
+    if (n == cap) {
+      cap = cap ? cap * 2 : 64;
+      list = xrealloc(list, cap * sizeof(*list));
+    }
+    list[n].dir = d;
+    list[n].path = join_path(path, e->d_name);
+    list[n].name = strlen(list[n].path) - strlen(e->d_name);
+    list[n].type = e->d_type;
+    n++;
+  }
+  closedir(dp);
+
+  __atomic_add_fetch(&d->refs, n, __ATOMIC_ACQ_REL);
+  while (n > 0)
+    push_item(gw, &list[--n]);
+  free(list);
+  dir_release(d);
+  wake_idle();
+}
+
+// Search one item: a file, or a directory whose entries get queued
+static void search_item(grep_worker *gw, grep_item *it) {
+  int dfd = it->dir ? it->dir->fd : AT_FDCWD;
+  const char *name = it->path + it->name;
+  int type = it->type, fd, flags = O_RDONLY | O_NOCTTY;
+  struct stat st;
+
+  if (it->dir == NULL && strcmp(it->path, "-") == 0) {
+    grep_fd(gw, STDIN_FILENO, "(standard input)");
+    return;
+  }
+  if (it->dir == NULL && it->path[0] == '\0')
+    name = "."; // -r without operands, the names are printed without ./
+
+  // Operands are followed when they are symbolic links, what -r finds in
+  // directories only with -R. Only directories and regular files are
+  // searched below the operands.
+  if (type == DT_UNKNOWN || (type == DT_LNK && recursive > 1)) {
+    if (fstatat(dfd, name, &st, it->dir && recursive == 1 ?
+                AT_SYMLINK_NOFOLLOW : 0) < 0) {
+      perror(it->path);
+      gw->error = 1;
+      return;
+    }
+    type = S_ISDIR(st.st_mode) ? DT_DIR : S_ISREG(st.st_mode) ? DT_REG
+                                        : S_ISLNK(st.st_mode) ? DT_LNK : 0;
+    if (it->dir == NULL && type == 0)
+      type = DT_REG; // Devices and fifos are read when named
+  }
+  if (type == DT_DIR && recursive) {
+    flags |= O_DIRECTORY;
+  } else if (type != DT_REG && (type != DT_DIR || it->dir)) {
+    return;
+  }
+  if (it->dir && recursive == 1)
+    flags |= O_NOFOLLOW;
+
+  fd = openat(dfd, name, flags);
+  if (fd < 0) {
+    perror(it->path);
+    gw->error = 1;
+    return;
+  }
+  if (type == DT_DIR && recursive) {
+    expand_dir(gw, it->dir, fd, it->path);
+    return;
+  }
+  grep_fd(gw, fd, it->path);
+  close(fd);
+}
+
+static void *search_worker(void *arg) {
+  grep_worker *gw = arg;
+  grep_item it;
+
+  for (;;) {
+    if (take_item(gw, &it)) {
+      if (!__atomic_load_n(&quit, __ATOMIC_RELAXED))
+        search_item(gw, &it);
+      free(it.path);
+      dir_release(it.dir);
+      if (__atomic_sub_fetch(&pending, 1, __ATOMIC_ACQ_REL) == 0)
+        wake_idle();
+      continue;
+    }
+
+    // Nothing to take: wait until something is queued or all is done
+    pthread_mutex_lock(&work_lock);
+    idle++;
+    while (__atomic_load_n(&queued, __ATOMIC_ACQUIRE) == 0 &&
+           __atomic_load_n(&pending, __ATOMIC_ACQUIRE) > 0)
+      pthread_cond_wait(&work_cond, &work_lock);
+    idle--;
+    pthread_mutex_unlock(&work_lock);
+    if (__atomic_load_n(&pending, __ATOMIC_ACQUIRE) == 0)
+      return NULL;
+  }
+}
+
+// Add the patterns of one -e argument or one -f line, a newline separates
+// several patterns like in other greps
+static void add_patterns(const char *s, size_t len) {
+  for (;;) {
+    const char *nl = memchr(s, '\n', len);
+    size_t n = nl ? (size_t)(nl - s) : len;
+
+    // Grow to 2^k - 1 entries whenever the count reaches that
+    if ((npatterns & (npatterns + 1)) == 0)
+      patterns = xrealloc(patterns, (npatterns * 2 + 1) * sizeof(*patterns));
+    patterns[npatterns].str = s;
+    patterns[npatterns++].len = n;
+    if (!nl)
+      break;
+    s = nl + 1;
+    len -= n + 1;
+  }
+}
+
+// Read one pattern per line, returns -1 if the file can't be read
+static int read_patterns(const char *path) {
+  int fd = strcmp(path, "-") == 0 ? STDIN_FILENO : open(path, O_RDONLY);
+  mb_reader r;
+  char *line;
+  size_t len;
+
+  if (fd < 0) {
+    perror(path);
+    return -1;
+  }
+  mb_reader_init(&r, fd);
+  while ((line = mb_next_line(&r, &len)) != NULL) {
+    char *copy;
+
+    if (line[len - 1] == '\n')
+      len--;
+    copy = xmalloc(len + 1);
+    memcpy(copy, line, len);
+    add_patterns(copy, len);
+  }
+  mb_reader_free(&r);
+  if (fd != STDIN_FILENO)
+    close(fd);
+  if (r.error) {
+    errno = r.error;
+    perror(path);
+    return -1;
+  }
+  return 0;
+}
+
+// Join all the patterns as one regex, alternatives separated by newlines,
+// and check that it compiles. Each thread compiles its own copy later.
+static int compile_regex(const char *prog) {
+  const char *error, *m;
+  size_t len = 0, mlen;
+  char *joined;
+  mb_regex *re;
+
+  for (size_t i = 0; i < npatterns; i++)
+    len += patterns[i].len + 1;
+  joined = xmalloc(len);
+  len = 0;
+  for (size_t i = 0; i < npatterns; i++) {
+    memcpy(joined + len, patterns[i].str, patterns[i].len);
+    len += patterns[i].len;
+    joined[len++] = '\n';
+  }
+  regex_src = joined;
+  regex_len = len ? len - 1 : 0;
+  re = mb_regex_compile(regex_src, regex_len, ignore_case, &error);
+  if (re == NULL) {
+    fprintf(stderr, "%s: %s\n", prog, error);
+    return -1;
+  }
+
+  // A single common byte would stop the search at nearly every line
+  m = mb_regex_must(re, &mlen);
+  if (mlen > 1 || (mlen == 1 && byte_rank(m[0]) <= 100)) {
+    char *copy = xmalloc(mlen);
+
+    literal_init(&must, memcpy(copy, m, mlen), mlen, ignore_case);
+  }
+  mb_regex_free(re);
+  return 0;
+}
+
+// Whether a pattern uses anything special in an extended regex
+static int has_regex_syntax(void) {
+  for (size_t i = 0; i < npatterns; i++) {
+    for (size_t j = 0; j < patterns[i].len; j++) {
+      if (patterns[i].str[j] && strchr("\\^$.[]|()*+?{}", patterns[i].str[j]))
+        return 1;
+    }
+  }
+  return 0;
+}
 
 /* grep program */
 int grep(int argc, char *argv[]) {
-  if (argc != 3) {
-    fprintf(stderr, "Usage: %s <pattern> <file>\n", argv[0]);
-    return EXIT_FAILURE;
+  long total = 0;
+  char **files = argv + 1;
+  pthread_t tids[MAX_THREADS];
+  grep_item top = {0};
+  int error = 0, have_patterns = 0, nfiles = 0, only_files = 0, extended = 0;
+  int started;
+  long around = -1;
+
+  // Options can come anywhere, the other arguments are packed into files[]
+  // as they are found
+  for (int i = 1; i < argc; i++) {
+    char *arg = argv[i];
+
+    if (only_files || arg[0] != '-' || arg[1] == '\0') {
+      files[nfiles++] = arg;
+      continue;
+    }
+    if (strcmp(arg, "--") == 0) {
+      only_files = 1;
+      continue;
+    }
+    for (int j = 1; arg[j]; j++) {
+      char opt = arg[j], *value;
+
+      if (opt == 'E' || opt == 'F') {
+        extended = opt == 'E';
+        continue;
+      }
+      if (opt == 'r' || opt == 'R') {
+        recursive = opt == 'r' ? 1 : 2;
+        continue;
+      }
+      if (opt == 'l' || opt == 'c' || opt == 'q') {
+        *(opt == 'l' ? &list_files : opt == 'c' ? &count_only : &quiet) = 1;
+        continue;
+      }
+      if (opt == 'i' || opt == 'a') {
+        *(opt == 'i' ? &ignore_case : &text) = 1;
+        continue;
+      }
+      if (!strchr("efABC", opt)) {
+        fprintf(stderr, "%s: invalid option -- '%c'\n", argv[0], opt);
+        goto usage;
+      }
+      // The value is the rest of this argument or the next one
+      value = arg[j + 1] ? &arg[j + 1] : argv[++i];
+      if (value == NULL) {
+        fprintf(stderr, "%s: option requires an argument -- '%c'\n", argv[0],
+                opt);
+        goto usage;
+      }
+      if (opt == 'A' || opt == 'B' || opt == 'C') {
+        char *end;
+        long n;
+
+        n = strtol(value, &end, 10);
+        if (!isdigit((unsigned char)*value) || *end) {
+          fprintf(stderr, "%s: %s: invalid context length argument\n",
+                  argv[0], value);
+          return 2;
+        }
+        // -A and -B win over -C whatever their order
+        *(opt == 'A' ? &after : opt == 'B' ? &before : &around) = n;
+        context = 1;
+        break;
+      }
+      if (opt == 'e')
+        add_patterns(value, strlen(value));
+      else if (read_patterns(value) < 0)
+        return 2;
+      have_patterns = 1;
+      break;
+    }
   }
 
-  const char *pattern = argv[1];
-  const char *filename = argv[2];
-  FILE *file = fopen(filename, "r");
+  after = after >= 0 ? after : around >= 0 ? around : 0;
+  before = before >= 0 ? before : around >= 0 ? around : 0;
+
+  if (!have_patterns) {
+    if (nfiles == 0)
+      goto usage;
+    add_patterns(files[0], strlen(files[0]));
+    files++;
+    nfiles--;
+  }
+  // -r prints the names unless all there is to search is one file
+  multiple_files = nfiles > 1;
+  if (recursive && nfiles <= 1) {
+    struct stat st;
 
-  if (!file) {
-    perror("Error opening file");
-    return EXIT_FAILURE;
+    multiple_files =
+        nfiles == 0 || (stat(files[0], &st) == 0 && S_ISDIR(st.st_mode));
   }
 
-  char line[1024]; // Buffer to store each line read from the file
-  while (fgets(line, sizeof(line), file)) {
-    if (strstr(line, pattern)) { // Check if the pattern is in the current line
-      printf("%s", line);        // Print the matching line
+  // Plain strings go to the fixed string searches even with -E
+  if (extended && has_regex_syntax()) {
+    if (compile_regex(argv[0]) < 0)
+      return 2;
+  } else {
+    // An empty pattern matches every line, no need for the automaton then
+    for (size_t i = 0; i < npatterns; i++) {
+      if (patterns[i].len == 0) {
+        patterns[0] = patterns[i];
+        npatterns = 1;
+      }
+    }
+    // The searches want the patterns in lower case to ignore the case
+    for (size_t i = 0; ignore_case && i < npatterns; i++) {
+      char *lower = xmalloc(patterns[i].len + 1);
+
+      for (size_t j = 0; j < patterns[i].len; j++)
+        lower[j] = mb_lower((unsigned char)patterns[i].str[j]);
+      patterns[i].str = lower;
     }
+    if (npatterns == 1)
+      literal_init(&lit, patterns[0].str, patterns[0].len, ignore_case);
+    else if (npatterns > 1)
+      ac = ac_build(patterns, npatterns, ignore_case);
+  }
+
+  // Only -r has more than one file at a time to search
+  num_workers = 1;
+  if (recursive) {
+    num_workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (num_workers < 1)
+      num_workers = 1;
+    if (num_workers > MAX_THREADS)
+      num_workers = MAX_THREADS;
+  }
+  workers = xzalloc(num_workers * sizeof(*workers));
+  for (int i = 0; i < num_workers; i++) {
+    const char *unused;
+
+    workers[i].id = i;
+    pthread_mutex_init(&workers[i].lock, NULL);
+    mb_reader_init(&workers[i].r, -1);
+    mb_writer_init(&workers[i].w, STDOUT_FILENO);
+    if (num_workers > 1)
+      workers[i].w.policy = MB_FLUSH_FULL;
+    if (regex_src)
+      workers[i].re =
+          mb_regex_compile(regex_src, regex_len, ignore_case, &unused);
   }
 
-  fclose(file);
-  return EXIT_SUCCESS;
+  // The operands go in reverse so they are searched in order. Without any,
+  // -r searches the current directory and prints the names without ./
+  top.type = DT_UNKNOWN;
+  if (nfiles == 0) {
+    top.path = xzalloc(2);
+    if (!recursive)
+      top.path[0] = '-';
+    push_item(&workers[0], &top);
+  }
+  for (int i = nfiles; i-- > 0;) {
+    top.path = strcpy(xmalloc(strlen(files[i]) + 1), files[i]);
+    push_item(&workers[0], &top);
+  }
+
+  // The main thread is worker 0. A worker left without a thread is harmless,
+  // only its own thread would queue anything on it.
+  for (started = 1; started < num_workers; started++) {
+    if (pthread_create(&tids[started], NULL, search_worker,
+                       &workers[started]) != 0)
+      break;
+  }
+  search_worker(&workers[0]);
+  for (int i = 1; i < started; i++)
+    pthread_join(tids[i], NULL);
+
+  for (int i = 0; i < num_workers; i++) {
+    total += workers[i].matches;
+    error |= workers[i].error;
+    mb_reader_free(&workers[i].r);
+    mb_writer_free(&workers[i].w);
+    mb_regex_free(workers[i].re);
+    free(workers[i].spill);
+  }
+  free(workers);
+
+  // Like other greps: 0 if a line matched, 1 if none did, 2 on errors. -q
+  // is successful as soon as a line matched.
+  if (quiet && total > 0)
+    return EXIT_SUCCESS;
+  if (error)
+    return 2;
+  return total > 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+
+usage:
+  fprintf(stderr,
+          "Usage: %s [-E|-F] [-acilqrR] [-A NUM] [-B NUM] [-C NUM] "
+          "[-e PATTERN]... [-f FILE]... [PATTERN] [file...]\n",
+          argv[0]);
+  return 2;
 }
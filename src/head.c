@@ -19,107 +19,400 @@
  * Licensed under Unlicense License, see file LICENSE in this source tree.
  */
 
+#ifdef __linux__
+#define _GNU_SOURCE // copy_file_range()
+#include <sys/sendfile.h>
+#endif
 #include "minibox.h"
+#include "libmb.h"
 
-static void print_usage(const char *prog_name) {
-  fprintf(
-      stderr,
-      "Usage: %s [-c num] [-n num] [file]\n"
-      "  -c num  Output the first `num` characters.\n"
-      "  -n num  Output the first `num` lines.\n"
-      "  file     File to read; if not provided, reads from standard input.\n",
-      prog_name);
+#include <ctype.h>
+#include <sys/stat.h>
+
+#define DEFAULT_LINES 10
+#define KERNEL_CHUNK (1 << 30) // Bytes asked for per kernel copy call
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HEAD_X86 1
+#endif
+
+static int quiet, verbose; // -q never prints headers, -v always does
+
+// Look for newlines from the start of p[0..len), each one found takes one
+// off *need. Returns the newline that brings it to 0, NULL with *need
+// lowered by the newlines of the block if there aren't enough.
+typedef const char *newline_func(const char *p, size_t len, uint64_t *need);
+
+static const char *newline_scalar(const char *p, size_t len, uint64_t *need) {
+  for (size_t i = 0; i < len; i++) {
+    if (p[i] == '\n' && --*need == 0)
+      return p + i;
+  }
+  return NULL;
+}
+
+#ifdef HEAD_X86
+// Both vector kernels only count the newlines of a vector until it holds
+// the one looked for, then drop the lowest bits of its mask up to it
+__attribute__((target("sse2"))) static const char *
+newline_sse2(const char *p, size_t len, uint64_t *need) {
+  const __m128i nl = _mm_set1_epi8('\n');
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    unsigned n = __builtin_popcount(m);
+
+    if (n < *need) {
+      *need -= n;
+      continue;
+    }
+    while (--*need > 0)
+      m &= m - 1;
+    return p + i + __builtin_ctz(m);
+  }
+  return newline_scalar(p + i, len - i, need);
+}
+
+__attribute__((target("avx2,popcnt"))) static const char *
+newline_avx2(const char *p, size_t len, uint64_t *need) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+    unsigned n = __builtin_popcount(m);
+
+    if (n < *need) {
+      *need -= n;
+      continue;
+    }
+    while (--*need > 0)
+      m &= m - 1;
+    return p + i + __builtin_ctz(m);
+  }
+  return newline_scalar(p + i, len - i, need);
+}
+#endif
+
+static newline_func *find_newline = newline_scalar;
+
+// Pick the widest kernel the CPU running us supports
+static void select_kernel(void) {
+#ifdef HEAD_X86
+  if (mb_simd_level() == MB_SIMD_AVX2)
+    find_newline = newline_avx2;
+  else if (mb_simd_level() == MB_SIMD_SSE2)
+    find_newline = newline_sse2;
+#endif
+}
+
+static uint64_t count_newlines(const char *p, size_t len) {
+  uint64_t need = UINT64_MAX;
+
+  find_newline(p, len, &need);
+  return UINT64_MAX - need;
+}
+
+// The first `count` lines. Reading stops at the block holding the last
+// newline, and a seekable input is put back right after it so that what
+// follows is left to whoever reads it next, like `(head -n 1; cat) < f`.
+static int head_lines(int fd, uint64_t count, mb_writer *w) {
+  mb_reader r;
+  const char *nl = NULL;
+  char *p;
+  size_t len;
+  int ret = 0;
+
+  mb_reader_init(&r, fd);
+  while (count > 0 && (p = mb_next_block(&r, &len)) != NULL) {
+    if ((nl = find_newline(p, len, &count)) != NULL) {
+      mb_write(w, p, nl + 1 - p);
+      lseek(fd, nl + 1 - (p + len), SEEK_CUR);
+      break;
+    }
+    mb_write(w, p, len);
+  }
+  if (r.error) {
+    errno = r.error;
+    ret = -1;
+  }
+  mb_reader_free(&r);
+  return ret;
+}
+
+// The first `count` bytes. A regular file is copied by the kernel,
+// anything else or whatever the kernel refused goes through the buffer.
+static int head_bytes(int fd, uint64_t count, mb_writer *w) {
+  mb_reader r;
+  char *p;
+  size_t len;
+  int ret = 0;
+
+#ifdef __linux__
+  struct stat st, out_st;
+  ssize_t n = -1;
+  uint64_t copied = 0;
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) &&
+      fstat(w->fd, &out_st) == 0 && mb_flush(w) == 0) {
+    while (count > 0) {
+      size_t chunk = count < KERNEL_CHUNK ? count : KERNEL_CHUNK;
+
+      if (S_ISREG(out_st.st_mode))
+        n = copy_file_range(fd, NULL, w->fd, NULL, chunk, 0);
+      else
+        n = sendfile(w->fd, fd, NULL, chunk);
+      if (n < 0 && errno == EINTR)
+        continue;
+      if (n <= 0)
+        break;
+      count -= n;
+      copied += n;
+    }
+    // Files in /proc and /sys look empty to the kernel copies
+    if (count == 0 || (n == 0 && copied > 0))
+      return 0;
+  }
+#endif
+  mb_reader_init(&r, fd);
+  while (count > 0 && (p = mb_next_block(&r, &len)) != NULL) {
+    if (len > count) {
+      lseek(fd, -(off_t)(len - count), SEEK_CUR);
+      len = count;
+    }
+    mb_write(w, p, len);
+    count -= len;
+  }
+  if (r.error) {
+    errno = r.error;
+    ret = -1;
+  }
+  mb_reader_free(&r);
+  return ret;
+}
+
+// All but the last `count` lines or bytes. The input is kept in a list of
+// chunks, and a chunk is printed as soon as the ones after it hold what
+// is held back, so memory is bounded by that and not by the input.
+typedef struct head_chunk {
+  struct head_chunk *next;
+  size_t len;
+  uint64_t lines; // Newlines in data
+  char data[MB_BUFSIZ];
+} head_chunk;
+
+static int head_all_but(int fd, int by_bytes, uint64_t count, mb_writer *w) {
+  head_chunk *first = NULL, *last = NULL, *spare = NULL, *c;
+  uint64_t lines = 0, bytes = 0, keep, k;
+  ssize_t n = 1;
+  int ends_nl = 0, err = 0;
+  struct stat st;
+
+  // A regular file knows its size, the last bytes need no holding back
+  if (by_bytes && fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+
+    if (pos >= 0 && st.st_size > pos)
+      return head_bytes(fd, (uint64_t)(st.st_size - pos) > count
+                                ? st.st_size - pos - count
+                                : 0,
+                        w);
+  }
+
+  while (n > 0) {
+    if (!last || last->len == MB_BUFSIZ) {
+      c = spare ? spare : xmalloc(sizeof(*c));
+      spare = NULL;
+      c->next = NULL;
+      c->len = c->lines = 0;
+      if (last)
+        last->next = c;
+      else
+        first = c;
+      last = c;
+    }
+    n = read(fd, last->data + last->len, MB_BUFSIZ - last->len);
+    if (n < 0 && errno == EINTR) {
+      n = 1;
+      continue;
+    }
+    if (n <= 0) {
+      err = n < 0 ? errno : 0;
+      break;
+    }
+    c = last;
+    k = count_newlines(c->data + c->len, n);
+    c->len += n;
+    c->lines += k;
+    lines += k;
+    bytes += n;
+    ends_nl = c->data[c->len - 1] == '\n';
+    while (first != last && (by_bytes ? bytes - first->len >= count
+                                      : lines - first->lines > count)) {
+      c = first;
+      first = c->next;
+      lines -= c->lines;
+      bytes -= c->len;
+      mb_write(w, c->data, c->len);
+      free(spare);
+      spare = c;
+    }
+  }
+  free(spare);
+
+  // Print what comes before the held back part of the chunks left
+  if (by_bytes) {
+    keep = bytes > count ? bytes - count : 0;
+  } else {
+    lines += bytes > 0 && !ends_nl; // A last line without its newline
+    keep = lines > count ? lines - count : 0;
+  }
+  for (c = first; c; c = first) {
+    const char *end = c->data;
+
+    if (by_bytes) {
+      k = keep < c->len ? keep : c->len;
+      end += k;
+      keep -= k;
+    } else if (keep > 0) {
+      const char *nl = find_newline(c->data, c->len, &keep);
+
+      end = nl ? nl + 1 : c->data + c->len;
+    }
+    mb_write(w, c->data, end - c->data);
+    first = c->next;
+    free(c);
+  }
+  errno = err;
+  return err ? -1 : 0;
+}
+
+// NUM of -n and -c, digits with a - in front for all but the last NUM
+static int parse_count(const char *arg, uint64_t *count, int *all_but) {
+  char *end;
+
+  if (arg == NULL)
+    return -1;
+  *all_but = *arg == '-';
+  arg += *all_but;
+  if (!isdigit((unsigned char)*arg))
+    return -1;
+  errno = 0;
+  *count = strtoull(arg, &end, 10);
+  return errno || *end ? -1 : 0;
+}
+
+static void print_usage(void) {
+  fprintf(stderr, "Usage: head [-qv] [-c [-]NUM] [-n [-]NUM] [file...]\n"
+                  "  -c NUM  Output the first NUM bytes, all but the last"
+                  " with -NUM.\n"
+                  "  -n NUM  Output the first NUM lines, all but the last"
+                  " with -NUM.\n"
+                  "  -q      Never print headers giving file names.\n"
+                  "  -v      Always print headers giving file names.\n"
+                  "  file    Files to read, - or none is standard input.\n");
 }
 
 int head(int argc, char *argv[]) {
-  int num_lines = 10; // Default number of lines
-  int num_chars = -1; // Default: no limit on number of characters
+  mb_writer w;
+  uint64_t count = DEFAULT_LINES;
+  int by_bytes = 0, all_but = 0, nfiles = 0, only_files = 0, printed = 0;
+  int ret = EXIT_SUCCESS;
 
-  // Parse command-line arguments manually
+  // Options can come anywhere, the files are packed at the start of argv
   for (int i = 1; i < argc; i++) {
-    if (argv[i][0] == '-') {
-      if (strcmp(argv[i], "-c") == 0) {
-        if (i + 1 < argc) {
-          num_chars = atoi(argv[++i]);
-          if (num_chars < 0) {
-            fprintf(stderr, "Invalid number of characters: %d\n", num_chars);
-            return EXIT_FAILURE;
-          }
-        } else {
-          fprintf(stderr, "Option -c requires an argument.\n");
-          print_usage(argv[0]);
-          return EXIT_FAILURE;
-        }
-      } else if (strcmp(argv[i], "-n") == 0) {
-        if (i + 1 < argc) {
-          num_lines = atoi(argv[++i]);
-          if (num_lines < 0) {
-            fprintf(stderr, "Invalid number of lines: %d\n", num_lines);
-            return EXIT_FAILURE;
-          }
-        } else {
-          fprintf(stderr, "Option -n requires an argument.\n");
-          print_usage(argv[0]);
-          return EXIT_FAILURE;
-        }
-      } else {
-        print_usage(argv[0]);
-        return EXIT_FAILURE;
-      }
-    } else {
-      // File argument found
-      FILE *input = fopen(argv[i], "r");
-      if (input == NULL) {
-        perror("fopen");
+    char *arg = argv[i];
+
+    if (only_files || arg[0] != '-' || arg[1] == '\0') {
+      argv[nfiles++] = arg;
+      continue;
+    }
+    if (strcmp(arg, "--") == 0) {
+      only_files = 1;
+      continue;
+    }
+    // -NUM is the old way of saying -n NUM
+    if (isdigit((unsigned char)arg[1])) {
+      by_bytes = 0;
+      if (parse_count(arg + 1, &count, &all_but) < 0) {
+        fprintf(stderr, "head: invalid number of lines: '%s'\n", arg + 1);
         return EXIT_FAILURE;
       }
+      continue;
+    }
+    for (int j = 1; arg[j]; j++) {
+      if (arg[j] == 'q') {
+        quiet = 1;
+        verbose = 0;
+      } else if (arg[j] == 'v') {
+        verbose = 1;
+        quiet = 0;
+      } else if (arg[j] == 'n' || arg[j] == 'c') {
+        // -n NUM or -nNUM
+        const char *num = arg[j + 1] ? arg + j + 1 : argv[++i];
 
-      // Read and output the desired content
-      if (num_chars >= 0) {
-        // Output the first `num_chars` characters
-        int c;
-        int count = 0;
-        while ((c = fgetc(input)) != EOF &&
-               (num_chars < 0 || count < num_chars)) {
-          putchar(c);
-          count++;
+        by_bytes = arg[j] == 'c';
+        if (parse_count(i < argc ? num : NULL, &count, &all_but) < 0) {
+          fprintf(stderr, "head: invalid number of %s: '%s'\n",
+                  by_bytes ? "bytes" : "lines", i < argc ? num : "");
+          return EXIT_FAILURE;
         }
+        break;
       } else {
-        // Output the first `num_lines` lines
-        char buffer[BUFSIZ];
-        int count = 0;
-        while (fgets(buffer, sizeof(buffer), input) != NULL &&
-               (num_lines < 0 || count < num_lines)) {
-          fputs(buffer, stdout);
-          count++;
-        }
+        fprintf(stderr, "head: invalid option -- '%c'\n", arg[j]);
+        print_usage();
+        return EXIT_FAILURE;
       }
-
-      fclose(input);
-      return EXIT_SUCCESS;
     }
   }
+  select_kernel();
+
+  mb_writer_init(&w, STDOUT_FILENO);
+  if (nfiles == 0)
+    argv[nfiles++] = "-";
+  for (int i = 0; i < nfiles; i++) {
+    int is_stdin = strcmp(argv[i], "-") == 0;
+    const char *name = is_stdin ? "standard input" : argv[i];
+    int fd = is_stdin ? STDIN_FILENO : open(argv[i], O_RDONLY);
+    int err;
 
-  // If no file argument, use stdin
-  FILE *input = stdin;
-  if (num_chars >= 0) {
-    // Output the first `num_chars` characters
-    int c;
-    int count = 0;
-    while ((c = fgetc(input)) != EOF && (num_chars < 0 || count < num_chars)) {
-      putchar(c);
-      count++;
+    if (fd < 0) {
+      fprintf(stderr, "head: cannot open '%s' for reading: %s\n", argv[i],
+              strerror(errno));
+      ret = EXIT_FAILURE;
+      continue;
     }
-  } else {
-    // Output the first `num_lines` lines
-    char buffer[BUFSIZ];
-    int count = 0;
-    while (fgets(buffer, sizeof(buffer), input) != NULL &&
-           (num_lines < 0 || count < num_lines)) {
-      fputs(buffer, stdout);
-      count++;
+    // Several files each get a header
+    if (verbose || (nfiles > 1 && !quiet)) {
+      const char *sep = printed ? "\n==> " : "==> ";
+
+      mb_write(&w, sep, strlen(sep));
+      mb_write(&w, name, strlen(name));
+      mb_write(&w, " <==\n", 5);
+    }
+    printed = 1;
+    if (all_but)
+      err = head_all_but(fd, by_bytes, count, &w);
+    else if (by_bytes)
+      err = head_bytes(fd, count, &w);
+    else
+      err = head_lines(fd, count, &w);
+    if (err < 0) {
+      fprintf(stderr, "head: error reading '%s': %s\n", name,
+              strerror(errno));
+      ret = EXIT_FAILURE;
     }
+    if (!is_stdin)
+      close(fd);
   }
-
-  return EXIT_SUCCESS;
+  if (mb_writer_free(&w) < 0 || w.error) {
+    errno = w.error;
+    perror("head: error writing 'standard output'");
+    return EXIT_FAILURE;
+  }
+  return ret;
 }
@@ -20,57 +20,824 @@
  */
 
 #include "minibox.h"
+#include "libmb.h"
 #include "utils.h"
 
-// Comparison function for qsort
+#include <pthread.h>
+
+#define DEFAULT_BUFFER_SIZE (32 * 1024 * 1024) // -S default
+#define MIN_BUFFER_SIZE (64 * 1024)
+#define MERGE_FANIN 16 // Runs merged at once, each one needs a reader buffer
+#define MAX_THREADS 64
+#define MIN_LINES_PER_THREAD 16384
+#define RADIX_CUTOFF 64 // Partitions this small are sorted by qsort
+#define RADIX_MAX_DEPTH 64 // So long common prefixes can't exhaust the stack
+
+// A line without its newline, the text lives in the run buffer or a reader.
+// The sort key is located once when the line is read, and its first bytes
+// (or a summary of its value for -n) are kept in `prefix` so most comparisons
+// never touch the text.
+typedef struct {
+  char *str;
+  size_t len;
+  char *key;
+  size_t key_len;
+  uint64_t prefix;
+} sort_line;
+
+// Half of a parallel sort or merge step
+typedef struct {
+  sort_line *src, *dst;
+  size_t lo, mid, hi;
+} sort_task;
+
+// Run buffer: line text grows up from the bottom and the sort_line records
+// grow down from the top, so the whole run fits in the -S budget
+typedef struct {
+  char *mem;
+  size_t size;
+  size_t used;  // Bytes of text
+  size_t count; // Number of records
+} sort_run;
+
+// One input of a merge and the line it currently offers
+typedef struct {
+  mb_reader r;
+  sort_line cur;
+} merge_src;
+
+static const char *temp_dir;
+static int opt_numeric, opt_reverse, opt_unique, num_threads = 1;
+static char field_sep;                  // -t, 0 for blank separated fields
+static size_t key_start, key_start_char; // -k F1[.C1], key_start 0 if no -k
+static size_t key_end, key_end_char;     // ,F2[.C2], key_end 0 to end of line
+static int *run_fds;
+static size_t num_runs, runs_capacity;
+
+static int compare_bytes(const char *a, size_t alen, const char *b,
+                         size_t blen) {
+  int ret = memcmp(a, b, alen < blen ? alen : blen);
+
+  if (ret)
+    return ret;
+  return (alen > blen) - (alen < blen);
+}
+
+// Start of field `n` (1 based), without -t the blanks before a field are
+// part of it
+static const char *field_start(const char *p, const char *end, size_t n) {
+  while (--n > 0 && p < end) {
+    if (field_sep) {
+      p = memchr(p, field_sep, end - p);
+      if (!p)
+        return end;
+      p++;
+    } else {
+      while (p < end && (*p == ' ' || *p == '\t'))
+        p++;
+      while (p < end && *p != ' ' && *p != '\t')
+        p++;
+    }
+  }
+  return p;
+}
+
+static const char *field_end(const char *p, const char *end) {
+  if (field_sep) {
+    const char *sep = memchr(p, field_sep, end - p);
+    return sep ? sep : end;
+  }
+  while (p < end && (*p == ' ' || *p == '\t'))
+    p++;
+  while (p < end && *p != ' ' && *p != '\t')
+    p++;
+  return p;
+}
+
+// A -n key split into sign, integer digits without leading zeros and
+// fraction digits without trailing zeros, so -0 and 0.50 read as 0 and 0.5
+typedef struct {
+  int negative;
+  const char *int_digits, *frac_digits;
+  size_t int_len, frac_len;
+} sort_number;
+
+static void parse_number(const char *p, const char *end, sort_number *n) {
+  n->negative = 0;
+  while (p < end && (*p == ' ' || *p == '\t'))
+    p++;
+  if (p < end && *p == '-') {
+    n->negative = 1;
+    p++;
+  }
+  while (p < end && *p == '0')
+    p++;
+  n->int_digits = p;
+  while (p < end && *p >= '0' && *p <= '9')
+    p++;
+  n->int_len = p - n->int_digits;
+  n->frac_digits = p;
+  n->frac_len = 0;
+  if (p < end && *p == '.') {
+    n->frac_digits = ++p;
+    while (p < end && *p >= '0' && *p <= '9')
+      p++;
+    n->frac_len = p - n->frac_digits;
+    while (n->frac_len && n->frac_digits[n->frac_len - 1] == '0')
+      n->frac_len--;
+  }
+  if (!n->int_len && !n->frac_len)
+    n->negative = 0;
+}
+
+// Exact order of two -n keys: sign, length of the integer part, its digits
+// and then the fraction digits
+static int compare_numbers(const char *a, size_t alen, const char *b,
+                           size_t blen) {
+  sort_number x, y;
+  int ret;
+
+  parse_number(a, a + alen, &x);
+  parse_number(b, b + blen, &y);
+  if (x.negative != y.negative)
+    return x.negative ? -1 : 1;
+  if (x.int_len != y.int_len)
+    ret = x.int_len < y.int_len ? -1 : 1;
+  else if (!(ret = memcmp(x.int_digits, y.int_digits, x.int_len)))
+    ret = compare_bytes(x.frac_digits, x.frac_len, y.frac_digits, y.frac_len);
+  return x.negative ? -ret : ret;
+}
+
+// Order preserving summary of a -n key: the sign bit, 7 bits of integer
+// length and the first 14 digits at 4 bits each, all inverted for negative
+// numbers. Keys that tie here are told apart by compare_numbers().
+static uint64_t number_prefix(const char *p, const char *end) {
+  sort_number n;
+  uint64_t bits;
+  size_t i;
+
+  parse_number(p, end, &n);
+  if (n.int_len >= 127) {
+    // Too long to summarize, all such keys tie and are compared exactly
+    bits = (uint64_t)127 << 56;
+  } else {
+    bits = (uint64_t)n.int_len << 56;
+    for (i = 0; i < 14; i++) {
+      int d = 0;
+
+      if (i < n.int_len)
+        d = n.int_digits[i] - '0';
+      else if (i - n.int_len < n.frac_len)
+        d = n.frac_digits[i - n.int_len] - '0';
+      bits |= (uint64_t)d << (52 - 4 * i);
+    }
+  }
+  return n.negative ? ~bits & ~((uint64_t)1 << 63) : bits | (uint64_t)1 << 63;
+}
+
+// Locate the key of a line and compute its prefix
+static void extract_key(sort_line *line) {
+  const char *p = line->str, *end = line->str + line->len, *q = end;
+
+  if (key_start) {
+    p = field_start(p, end, key_start);
+    if (key_start_char > 1)
+      p = (size_t)(end - p) > key_start_char - 1 ? p + key_start_char - 1
+                                                  : end;
+    if (key_end) {
+      q = field_start(line->str, end, key_end);
+      if (key_end_char)
+        q = (size_t)(end - q) > key_end_char ? q + key_end_char : end;
+      else
+        q = field_end(q, end);
+    }
+    if (q < p)
+      q = p;
+  }
+  line->key = (char *)p;
+  line->key_len = q - p;
+
+  if (opt_numeric) {
+    line->prefix = number_prefix(p, q);
+  } else {
+    // First 8 bytes of the key, big endian so integer order is byte order
+    line->prefix = 0;
+    for (int i = 0; i < 8; i++)
+      line->prefix = line->prefix << 8 |
+                     (i < (int)line->key_len ? (unsigned char)p[i] : 0);
+  }
+}
+
+// Compare the keys only, this decides what -u considers equal
+static int compare_keys(const sort_line *x, const sort_line *y) {
+  size_t n;
+
+  if (x->prefix != y->prefix)
+    return x->prefix < y->prefix ? -1 : 1;
+  if (opt_numeric)
+    return compare_numbers(x->key, x->key_len, y->key, y->key_len);
+  // Equal prefixes mean the first n bytes are equal
+  n = x->key_len < y->key_len ? x->key_len : y->key_len;
+  if (n > 8)
+    n = 8;
+  return compare_bytes(x->key + n, x->key_len - n, y->key + n,
+                       y->key_len - n);
+}
+
+// Comparison function for qsort, the keys and then the whole lines in byte
+// order as a last resort (not with -u)
 int compare_lines(const void *a, const void *b) {
-  return strcmp(*(const char **)a, *(const char **)b);
+  const sort_line *x = a, *y = b;
+  int ret = compare_keys(x, y);
+
+  if (ret == 0 && !opt_unique && (key_start || opt_numeric))
+    ret = compare_bytes(x->str, x->len, y->str, y->len);
+  return opt_reverse ? -ret : ret;
 }
 
-/* sort program */
-int sort(int argc, char *argv[]) {
-  char *lines[1000]; // Array to store lines (simple fixed-size buffer)
+// Same for lines of one run buffer, where the text is stored in input order,
+// so equal lines keep their input order and -u keeps the first one
+static int compare_run_lines(const void *a, const void *b) {
+  const sort_line *x = a, *y = b;
+  int ret = compare_lines(x, y);
+
+  if (ret == 0)
+    ret = (x->str > y->str) - (x->str < y->str);
+  return ret;
+}
+
+static sort_line *run_lines(sort_run *run) {
+  return (sort_line *)(run->mem + run->size) - run->count;
+}
+
+// Records needed per line, a parallel sort merges through a second array
+// placed in the free space between the text and the records
+static size_t record_size(void) {
+  return sizeof(sort_line) * (num_threads > 1 ? 2 : 1);
+}
+
+static int run_add(sort_run *run, const char *str, size_t len) {
+  size_t need = len + record_size() + 16;
+  sort_line *line;
+
+  if (run->size - run->used - run->count * record_size() < need)
+    return 0;
+  memcpy(run->mem + run->used, str, len);
+  run->count++;
+  line = run_lines(run);
+  line->str = run->mem + run->used;
+  line->len = len;
+  extract_key(line);
+  run->used += len;
+  return 1;
+}
+
+// Make room for a line longer than the whole budget, only done on an empty
+// run so no record points into the old memory
+static void run_grow(sort_run *run, size_t len) {
+  size_t size = len + record_size() + 16;
+
+  size = (size + 15) & ~(size_t)15;
+  free(run->mem);
+  run->mem = xmalloc(size);
+  run->size = size;
+}
+
+static void write_lines(mb_writer *w, sort_line *lines, size_t count) {
+  for (size_t i = 0; i < count; i++) {
+    if (opt_unique && i > 0 && compare_keys(&lines[i - 1], &lines[i]) == 0)
+      continue;
+    mb_write(w, lines[i].str, lines[i].len);
+    mb_putc(w, '\n');
+  }
+}
+
+// Byte `d` of a line plus one, 0 past its end so shorter lines sort first.
+// The first 8 bytes come from the prefix in the record, not from the text.
+static int line_byte(const sort_line *line, size_t d) {
+  if (d >= line->len)
+    return 0;
+  if (d < 8)
+    return (line->prefix >> (56 - 8 * d) & 0xff) + 1;
+  return (unsigned char)line->str[d] + 1;
+}
+
+static void swap_lines(sort_line *a, sort_line *b) {
+  sort_line tmp = *a;
+  *a = *b;
+  *b = tmp;
+}
+
+// Ascending byte order for the radix sort, -r reverses its result instead
+static int compare_ascending(const void *a, const void *b) {
+  return compare_keys(a, b);
+}
+
+// MSD radix sort (American flag sort) of lines whose first `d` bytes are
+// known to be equal: count the lines per value of byte `d`, move every line
+// into its bucket in place and sort each bucket on the next byte. Buckets of
+// RADIX_CUTOFF lines or less, or past RADIX_MAX_DEPTH bytes, are left to
+// qsort.
+static void radix_sort(sort_line *a, size_t n, size_t d) {
+  size_t count[257] = {0}, next[257];
+
+  if (n <= RADIX_CUTOFF || d >= RADIX_MAX_DEPTH) {
+    qsort(a, n, sizeof(sort_line), compare_ascending);
+    return;
+  }
+
+  for (size_t i = 0; i < n; i++)
+    count[line_byte(&a[i], d)]++;
+  next[0] = 0;
+  for (int c = 1; c < 257; c++)
+    next[c] = next[c - 1] + count[c - 1];
+
+  // Swap every misplaced line into the bucket it belongs to
+  size_t start = 0;
+  for (int c = 0; c < 257; start += count[c++]) {
+    while (next[c] < start + count[c]) {
+      int v = line_byte(&a[next[c]], d);
+
+      if (v == c)
+        next[c]++;
+      else
+        swap_lines(&a[next[c]], &a[next[v]++]);
+    }
+  }
+
+  // Bucket 0 holds the lines that ended, they are identical
+  start = count[0];
+  for (int c = 1; c < 257; start += count[c++]) {
+    if (count[c] > 1)
+      radix_sort(a + start, count[c], d + 1);
+  }
+}
+
+// Plain byte order sorts go through the radix sort, keyed and numeric ones
+// through qsort
+static void sort_slice(sort_line *lines, size_t count) {
+  if (key_start || opt_numeric) {
+    qsort(lines, count, sizeof(sort_line), compare_run_lines);
+    return;
+  }
+
+  radix_sort(lines, count, 0);
+  if (opt_reverse) {
+    for (size_t i = 0; i < count / 2; i++)
+      swap_lines(&lines[i], &lines[count - 1 - i]);
+  }
+}
+
+static void *sort_worker(void *arg) {
+  sort_task *t = arg;
+
+  sort_slice(t->src + t->lo, t->hi - t->lo);
+  return NULL;
+}
+
+static void *merge_worker(void *arg) {
+  sort_task *t = arg;
+  size_t i = t->lo, j = t->mid, k = t->lo;
+
+  while (i < t->mid && j < t->hi)
+    t->dst[k++] = compare_run_lines(&t->src[j], &t->src[i]) < 0
+                      ? t->src[j++]
+                      : t->src[i++];
+  while (i < t->mid)
+    t->dst[k++] = t->src[i++];
+  while (j < t->hi)
+    t->dst[k++] = t->src[j++];
+  return NULL;
+}
+
+// Run the tasks on their own threads, the first one on the calling thread
+static void run_tasks(void *(*fn)(void *), sort_task *tasks, int n) {
+  pthread_t tids[MAX_THREADS];
+  int started[MAX_THREADS] = {0};
+
+  for (int i = 1; i < n; i++)
+    started[i] = pthread_create(&tids[i], NULL, fn, &tasks[i]) == 0;
+  fn(&tasks[0]);
+  for (int i = 1; i < n; i++) {
+    if (started[i])
+      pthread_join(tids[i], NULL);
+    else
+      fn(&tasks[i]);
+  }
+}
+
+// Sort the lines with up to num_threads threads: every thread sorts a slice,
+// then the slices are merged pairwise, in parallel too, between `lines` and
+// `scratch`. Returns the array holding the result.
+static sort_line *sort_lines(sort_line *lines, sort_line *scratch,
+                             size_t count) {
+  sort_task tasks[MAX_THREADS];
+  size_t bounds[MAX_THREADS + 1];
+  int n = num_threads;
+
+  if ((size_t)n > count / MIN_LINES_PER_THREAD)
+    n = count / MIN_LINES_PER_THREAD;
+  if (n <= 1) {
+    sort_slice(lines, count);
+    return lines;
+  }
+
+  for (int i = 0; i <= n; i++)
+    bounds[i] = count * i / n;
+  for (int i = 0; i < n; i++)
+    tasks[i] = (sort_task){lines, scratch, bounds[i], 0, bounds[i + 1]};
+  run_tasks(sort_worker, tasks, n);
+
+  while (n > 1) {
+    int m = 0;
+
+    for (int i = 0; i < n; i += 2, m++) {
+      size_t hi = i + 1 < n ? bounds[i + 2] : bounds[i + 1];
+      tasks[m] = (sort_task){lines, scratch, bounds[i], bounds[i + 1], hi};
+      bounds[m] = bounds[i];
+    }
+    bounds[m] = count;
+    run_tasks(merge_worker, tasks, m);
+
+    sort_line *tmp = lines;
+    lines = scratch;
+    scratch = tmp;
+    n = m;
+  }
+  return lines;
+}
+
+// Unlinked temporary file, it goes away by itself once closed
+static int temp_file(void) {
+  size_t len = strlen(temp_dir) + sizeof("/minibox-sortXXXXXX");
+  char *path = xmalloc(len);
+  int fd;
+
+  snprintf(path, len, "%s/minibox-sortXXXXXX", temp_dir);
+  fd = mkstemp(path);
+  if (fd < 0) {
+    perror(path);
+    exit(EXIT_FAILURE);
+  }
+  unlink(path);
+  free(path);
+  return fd;
+}
+
+static void add_run_fd(int fd) {
+  if (num_runs == runs_capacity) {
+    runs_capacity = runs_capacity ? runs_capacity * 2 : 16;
+    run_fds = xrealloc(run_fds, runs_capacity * sizeof(int));
+  }
+  run_fds[num_runs++] = fd;
+}
+
+// Sort the run buffer and write it out to stdout or to a new temporary run
+static void flush_run(sort_run *run, int to_temp) {
+  sort_line *scratch = (sort_line *)(run->mem + ((run->used + 15) & ~15));
+  sort_line *lines = sort_lines(run_lines(run), scratch, run->count);
+  int fd = to_temp ? temp_file() : STDOUT_FILENO;
+  mb_writer w;
+
+  mb_writer_init(&w, fd);
+  write_lines(&w, lines, run->count);
+  if (mb_writer_free(&w) < 0) {
+    errno = w.error;
+    perror(to_temp ? "Error writing temporary file" : "Error writing output");
+    exit(EXIT_FAILURE);
+  }
+  if (to_temp) {
+    lseek(fd, 0, SEEK_SET);
+    add_run_fd(fd);
+  }
+  run->used = run->count = 0;
+}
+
+static int src_next(merge_src *src) {
+  size_t len;
+  char *p = mb_next_line(&src->r, &len);
+
+  if (!p)
+    return 0;
+  if (len > 0 && p[len - 1] == '\n')
+    len--;
+  src->cur.str = p;
+  src->cur.len = len;
+  extract_key(&src->cur);
+  return 1;
+}
+
+// Runs are numbered in input order, equal lines come from the earlier run
+static int src_less(const merge_src *a, const merge_src *b) {
+  int ret = compare_lines(&a->cur, &b->cur);
+
+  return ret < 0 || (ret == 0 && a < b);
+}
+
+static void sift_down(merge_src **heap, size_t n, size_t i) {
+  for (;;) {
+    size_t min = i, l = 2 * i + 1, r = l + 1;
+
+    if (l < n && src_less(heap[l], heap[min]))
+      min = l;
+    if (r < n && src_less(heap[r], heap[min]))
+      min = r;
+    if (min == i)
+      return;
+    merge_src *tmp = heap[i];
+    heap[i] = heap[min];
+    heap[min] = tmp;
+    i = min;
+  }
+}
+
+// k-way merge of sorted inputs through a min-heap of their current lines,
+// the input descriptors are closed
+static void merge_fds(int *fds, size_t n, int out_fd) {
+  merge_src *srcs = xmalloc(n * sizeof(merge_src));
+  merge_src **heap = xmalloc(n * sizeof(merge_src *));
   size_t count = 0;
-  size_t capacity = sizeof(lines) / sizeof(lines[0]);
-
-  // Read lines from standard input or file if provided
-  FILE *file = stdin;
-  if (argc == 2) {
-    file = fopen(argv[1], "r");
-    if (!file) {
-      perror("Error opening file");
-      return EXIT_FAILURE;
+  mb_writer w;
+  sort_line last = {0}; // Copy of the last line written, for -u
+  size_t last_size = 0;
+  int have_last = 0;
+
+  for (size_t i = 0; i < n; i++) {
+    mb_reader_init(&srcs[i].r, fds[i]);
+    if (src_next(&srcs[i]))
+      heap[count++] = &srcs[i];
+  }
+  for (size_t i = count / 2; i-- > 0;)
+    sift_down(heap, count, i);
+
+  mb_writer_init(&w, out_fd);
+  while (count > 0) {
+    sort_line *cur = &heap[0]->cur;
+
+    if (!opt_unique) {
+      mb_write(&w, cur->str, cur->len);
+      mb_putc(&w, '\n');
+    } else if (!have_last || compare_keys(&last, cur) != 0) {
+      mb_write(&w, cur->str, cur->len);
+      mb_putc(&w, '\n');
+      if (cur->len > last_size) {
+        last_size = cur->len;
+        last.str = xrealloc(last.str, last_size);
+      }
+      memcpy(last.str, cur->str, cur->len);
+      last.len = cur->len;
+      extract_key(&last);
+      have_last = 1;
     }
+    if (!src_next(heap[0]))
+      heap[0] = heap[--count];
+    sift_down(heap, count, 0);
+  }
+  if (mb_writer_free(&w) < 0) {
+    errno = w.error;
+    perror("Error writing output");
+    exit(EXIT_FAILURE);
   }
 
-  char buffer[1024];
-  while (fgets(buffer, sizeof(buffer), file)) {
-    if (count >= capacity) {
-      fprintf(stderr, "Too many lines to sort\n");
-      return EXIT_FAILURE;
+  for (size_t i = 0; i < n; i++) {
+    if (srcs[i].r.error) {
+      errno = srcs[i].r.error;
+      perror("Error reading input");
+      exit(EXIT_FAILURE);
+    }
+    mb_reader_free(&srcs[i].r);
+    close(fds[i]);
+  }
+  free(last.str);
+  free(heap);
+  free(srcs);
+}
+
+// Merge the runs MERGE_FANIN at a time into bigger runs until a single pass
+// can write the output
+static void merge_runs(int out_fd) {
+  while (num_runs > MERGE_FANIN) {
+    size_t done = 0, merged = 0;
+
+    while (done < num_runs) {
+      size_t n = num_runs - done < MERGE_FANIN ? num_runs - done : MERGE_FANIN;
+      int fd = temp_file();
+
+      merge_fds(run_fds + done, n, fd);
+      lseek(fd, 0, SEEK_SET);
+      run_fds[merged++] = fd;
+      done += n;
+    }
+    num_runs = merged;
+  }
+  merge_fds(run_fds, num_runs, out_fd);
+  num_runs = 0;
+}
+
+// Parse a -S size, a number with an optional K, M or G suffix (K if none)
+static size_t parse_size(const char *arg) {
+  char *end;
+  unsigned long long size = strtoull(arg, &end, 10);
+
+  switch (*end) {
+  case 'G':
+  case 'g':
+    size *= 1024;
+    /* fallthrough */
+  case 'M':
+  case 'm':
+    size *= 1024;
+    /* fallthrough */
+  case 'K':
+  case 'k':
+  case '\0':
+    size *= 1024;
+    break;
+  case 'b':
+    break;
+  default:
+    return 0;
+  }
+  return size;
+}
+
+// Parse -k F1[.C1][,F2[.C2]]
+static int parse_key(const char *arg) {
+  char *end;
+
+  key_start = strtoul(arg, &end, 10);
+  key_start_char = *end == '.' ? strtoul(end + 1, &end, 10) : 0;
+  key_end = key_end_char = 0;
+  if (*end == ',') {
+    key_end = strtoul(end + 1, &end, 10);
+    key_end_char = *end == '.' ? strtoul(end + 1, &end, 10) : 0;
+    if (key_end == 0)
+      return 0;
+  }
+  // Ordering letters after the key, there is only one key so they apply to
+  // the whole comparison
+  for (; *end == 'n' || *end == 'r'; end++) {
+    if (*end == 'n')
+      opt_numeric = 1;
+    else
+      opt_reverse = 1;
+  }
+  return key_start > 0 && *end == '\0';
+}
+
+// Argument of an option given either as -Xarg or -X arg
+static char *option_arg(int argc, char *argv[], int *i) {
+  if (argv[*i][2] != '\0')
+    return argv[*i] + 2;
+  if (*i + 1 < argc)
+    return argv[++*i];
+  return NULL;
+}
+
+static void print_usage(const char *prog_name) {
+  fprintf(stderr,
+          "Usage: %s [-mnru] [-k F1[.C1][,F2[.C2]]] [-t sep] [-S size] "
+          "[-T dir] [--parallel=N] [file...]\n"
+          "  -k key   Sort on the key from field F1 (char C1) to field F2\n"
+          "           (char C2), fields and chars are counted from 1.\n"
+          "  -t sep   Fields are separated by sep instead of blanks.\n"
+          "  -n       Compare keys as numbers.\n"
+          "  -r       Reverse the order.\n"
+          "  -u       Output only the first of lines with equal keys.\n"
+          "  -m       Merge already sorted files, do not sort.\n"
+          "  -S size  Memory buffer size (K, M, G suffix, default 32M).\n"
+          "  -T dir   Directory for temporary files (default $TMPDIR or "
+          "/tmp).\n"
+          "  --parallel=N  Sort with N threads.\n",
+          prog_name);
+}
+
+/* sort program */
+int sort(int argc, char *argv[]) {
+  size_t buffer_size = DEFAULT_BUFFER_SIZE;
+  int merge_only = 0;
+  int num_files = 0;
+
+  temp_dir = getenv("TMPDIR");
+  if (!temp_dir || !*temp_dir)
+    temp_dir = "/tmp";
+
+  // Parse command-line arguments manually, files are compacted in argv
+  for (int i = 1; i < argc; i++) {
+    char *arg = argv[i];
+
+    if (arg[0] != '-' || arg[1] == '\0') {
+      argv[1 + num_files++] = arg;
+    } else if (strncmp(arg, "--parallel=", 11) == 0) {
+      num_threads = atoi(arg + 11);
+      if (num_threads < 1)
+        num_threads = 1;
+      if (num_threads > MAX_THREADS)
+        num_threads = MAX_THREADS;
+    } else if (arg[1] == 'S' || arg[1] == 'T' || arg[1] == 'k' ||
+               arg[1] == 't') {
+      char *value = option_arg(argc, argv, &i);
+
+      if (!value) {
+        print_usage(argv[0]);
+        return EXIT_FAILURE;
+      }
+      if (arg[1] == 'T') {
+        temp_dir = value;
+      } else if (arg[1] == 't') {
+        field_sep = value[0];
+      } else if (arg[1] == 'k' && !parse_key(value)) {
+        fprintf(stderr, "Invalid key: %s\n", value);
+        return EXIT_FAILURE;
+      } else if (arg[1] == 'S' && (buffer_size = parse_size(value)) == 0) {
+        fprintf(stderr, "Invalid buffer size: %s\n", value);
+        return EXIT_FAILURE;
+      }
+    } else {
+      // Flags can be combined, as in -nru
+      for (char *f = arg + 1; *f; f++) {
+        if (*f == 'm') {
+          merge_only = 1;
+        } else if (*f == 'n') {
+          opt_numeric = 1;
+        } else if (*f == 'r') {
+          opt_reverse = 1;
+        } else if (*f == 'u') {
+          opt_unique = 1;
+        } else {
+          print_usage(argv[0]);
+          return EXIT_FAILURE;
+        }
+      }
     }
-    // Remove newline character and allocate memory for line
-    buffer[strcspn(buffer, "\n")] = '\0';
-    lines[count] = strdup(buffer);
-    if (!lines[count]) {
-      perror("Memory allocation failed");
+  }
+  if (num_files == 0)
+    argv[1 + num_files++] = "-";
+
+  // Open every input up front so errors are reported before any output
+  int *fds = xmalloc(num_files * sizeof(int));
+  for (int i = 0; i < num_files; i++) {
+    const char *name = argv[1 + i];
+    fds[i] = strcmp(name, "-") == 0 ? STDIN_FILENO : open(name, O_RDONLY);
+    if (fds[i] < 0) {
+      perror(name);
       return EXIT_FAILURE;
     }
-    count++;
   }
 
-  if (file != stdin) {
-    fclose(file);
+  if (merge_only) {
+    merge_fds(fds, num_files, STDOUT_FILENO);
+    free(fds);
+    return EXIT_SUCCESS;
   }
 
-  // Sort the lines
-  qsort(lines, count, sizeof(char *), compare_lines);
+  if (buffer_size < MIN_BUFFER_SIZE)
+    buffer_size = MIN_BUFFER_SIZE;
+  sort_run run = {0};
+  run.size = buffer_size & ~(size_t)15;
+  run.mem = xmalloc(run.size);
 
-  // Print the sorted lines
-  for (size_t i = 0; i < count; i++) {
-    puts(lines[i]);
-    free(lines[i]);
+  // Collect lines into the run buffer, each time it fills up sort it and
+  // spill it to a temporary file
+  for (int i = 0; i < num_files; i++) {
+    mb_reader r;
+    char *p;
+    size_t len;
+
+    mb_reader_init(&r, fds[i]);
+    while ((p = mb_next_line(&r, &len)) != NULL) {
+      if (len > 0 && p[len - 1] == '\n')
+        len--;
+      if (run_add(&run, p, len))
+        continue;
+      if (run.count > 0)
+        flush_run(&run, 1);
+      if (!run_add(&run, p, len)) {
+        run_grow(&run, len);
+        run_add(&run, p, len);
+      }
+    }
+    if (r.error) {
+      errno = r.error;
+      perror(argv[1 + i]);
+      return EXIT_FAILURE;
+    }
+    mb_reader_free(&r);
+    if (fds[i] != STDIN_FILENO)
+      close(fds[i]);
+  }
+  free(fds);
+
+  if (num_runs == 0) {
+    // Everything fit in memory
+    flush_run(&run, 0);
+  } else {
+    if (run.count > 0)
+      flush_run(&run, 1);
+    merge_runs(STDOUT_FILENO);
   }
 
+  free(run.mem);
+  free(run_fds);
   return EXIT_SUCCESS;
 }
@@ -20,135 +20,579 @@
  */
 
 #include "minibox.h"
+#include "libmb.h"
+
+#include <ctype.h>
+#include <poll.h>
+#include <sys/stat.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#endif
 
 #define DEFAULT_LINES 10
-#define DEFAULT_BYTES 1024
 
-int tail(int argc, char *argv[]) {
-  int lines = DEFAULT_LINES;
-  int bytes = DEFAULT_BYTES;
-  int follow = 0;
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define TAIL_X86 1
+#endif
 
-  // Manual argument parsing
-  for (int i = 1; i < argc; i++) {
-    if (argv[i][0] == '-') {
-      if (strcmp(argv[i], "-c") == 0) {
-        if (i + 1 < argc) {
-          bytes = atoi(argv[++i]);
-        } else {
-          fprintf(stderr, "Error: Option -c requires an argument.\n");
-          return 1;
-        }
-      } else if (strcmp(argv[i], "-n") == 0) {
-        if (i + 1 < argc) {
-          lines = atoi(argv[++i]);
-        } else {
-          fprintf(stderr, "Error: Option -n requires an argument.\n");
-          return 1;
-        }
-      } else if (strcmp(argv[i], "-f") == 0) {
-        follow = 1;
-      } else {
-        fprintf(stderr, "Usage: %s [-c bytes] [-n lines] [-f] [file...]\n",
-                argv[0]);
-        return 1;
-      }
-    } else {
-      // Handle file arguments
+// Look for newlines backward from the end of p[0..len), each one found
+// takes one off *need. Returns the newline that brings it to 0, NULL with
+// *need lowered by the newlines of the block if there aren't enough.
+typedef const char *newline_func(const char *p, size_t len, uint64_t *need);
+
+static const char *newline_back_scalar(const char *p, size_t len,
+                                       uint64_t *need) {
+  while (len-- > 0) {
+    if (p[len] == '\n' && --*need == 0)
+      return p + len;
+  }
+  return NULL;
+}
+
+#ifdef TAIL_X86
+// Both vector kernels go backward a vector at a time and only look at the
+// bits of the newline mask once the vector holds the one looked for. The
+// bytes left at the start of the block go to the scalar kernel.
+__attribute__((target("sse2"))) static const char *
+newline_back_sse2(const char *p, size_t len, uint64_t *need) {
+  const __m128i nl = _mm_set1_epi8('\n');
+
+  for (; len >= 16; len -= 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + len - 16));
+    unsigned m = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    unsigned n = __builtin_popcount(m);
+
+    if (n < *need) {
+      *need -= n;
+      continue;
+    }
+    while (--*need > 0)
+      m &= ~(1u << (31 - __builtin_clz(m)));
+    return p + len - 16 + (31 - __builtin_clz(m));
+  }
+  return newline_back_scalar(p, len, need);
+}
+
+__attribute__((target("avx2,popcnt"))) static const char *
+newline_back_avx2(const char *p, size_t len, uint64_t *need) {
+  const __m256i nl = _mm256_set1_epi8('\n');
+
+  for (; len >= 32; len -= 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + len - 32));
+    unsigned m = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+    unsigned n = __builtin_popcount(m);
+
+    if (n < *need) {
+      *need -= n;
+      continue;
+    }
+    while (--*need > 0)
+      m &= ~(1u << (31 - __builtin_clz(m)));
+    return p + len - 32 + (31 - __builtin_clz(m));
+  }
+  return newline_back_scalar(p, len, need);
+}
+#endif
+
+static newline_func *newline_back = newline_back_scalar;
+
+// Pick the widest kernel the CPU running us supports
+static void select_kernel(void) {
+#ifdef TAIL_X86
+  if (mb_simd_level() == MB_SIMD_AVX2)
+    newline_back = newline_back_avx2;
+  else if (mb_simd_level() == MB_SIMD_SSE2)
+    newline_back = newline_back_sse2;
+#endif
+}
+
+// Where the last `lines` lines of a seekable file of `size` bytes start.
+// Blocks of buf are read backward from the end until they hold enough
+// newlines, so only the tail of the file is ever read and the memory used
+// doesn't depend on its size. The blocks are MB_BUFSIZ aligned.
+static off_t lines_start(int fd, off_t size, uint64_t lines, char *buf) {
+  off_t end = size;
+  int last = 1;
+
+  if (lines == 0)
+    return size;
+  while (end > 0) {
+    size_t len = end % MB_BUFSIZ ? end % MB_BUFSIZ : MB_BUFSIZ;
+    off_t pos = end - len;
+    ssize_t n = pread(fd, buf, len, pos);
+    const char *nl;
+
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0)
+      return -1;
+    // The newline ending the file ends the last line, it doesn't start one
+    if (last && n > 0 && buf[n - 1] == '\n')
+      n--;
+    last = 0;
+    if ((nl = newline_back(buf, n, &lines)) != NULL)
+      return pos + (nl - buf) + 1;
+    end = pos;
+  }
+  return 0;
+}
+
+// Input that can't seek, like a pipe, is kept in a list of chunks. The
+// oldest ones are dropped as soon as the ones after them hold what is to
+// be printed, so memory grows with the output and not with the input.
+typedef struct tail_chunk {
+  struct tail_chunk *next;
+  size_t len;
+  uint64_t lines; // Newlines in data
+  char data[MB_BUFSIZ];
+} tail_chunk;
+
+static uint64_t count_newlines(const char *p, size_t len) {
+  uint64_t need = UINT64_MAX;
+
+  newline_back(p, len, &need);
+  return UINT64_MAX - need;
+}
+
+static int tail_stream(int fd, int by_bytes, uint64_t count, mb_writer *w) {
+  tail_chunk *head = NULL, *last = NULL, *c;
+  uint64_t lines = 0, bytes = 0, skip, k;
+  ssize_t n = 1;
+  int ends_nl = 0; // The input ends with a newline
+  int err = 0;
+
+  while (n > 0) {
+    if (!last || last->len == MB_BUFSIZ) {
+      c = xmalloc(sizeof(*c));
+      c->next = NULL;
+      c->len = c->lines = 0;
+      if (last)
+        last->next = c;
+      else
+        head = c;
+      last = c;
+    }
+    n = read(fd, last->data + last->len, MB_BUFSIZ - last->len);
+    if (n < 0 && errno == EINTR) {
+      n = 1;
+      continue;
+    }
+    if (n <= 0) {
+      err = n < 0 ? errno : 0;
       break;
     }
+    c = last;
+    k = count_newlines(c->data + c->len, n);
+    c->len += n;
+    c->lines += k;
+    lines += k;
+    bytes += n;
+    ends_nl = c->data[c->len - 1] == '\n';
+    while (head != last && (by_bytes ? bytes - head->len >= count
+                                     : lines - head->lines > count)) {
+      c = head;
+      head = c->next;
+      lines -= c->lines;
+      bytes -= c->len;
+      free(c);
+    }
   }
 
-  if (argc <= 1 ||
-      (argc > 1 && argv[1][0] == '-' && strcmp(argv[1], "--") != 0)) {
-    fprintf(stderr, "No file specified\n");
-    return 1;
+  // Skip what comes before the output in the chunks left
+  if (by_bytes) {
+    skip = bytes > count ? bytes - count : 0;
+  } else {
+    lines += bytes > 0 && !ends_nl; // A last line without its newline
+    skip = lines > count ? lines - count : 0;
   }
+  for (c = head; c; c = head) {
+    const char *p = c->data, *end = c->data + c->len;
 
-  for (int i = argc - (argc - (argv[1][0] == '-' ? 2 : 1)); i < argc; i++) {
-    const char *filename = argv[i];
-    int fd = open(filename, O_RDONLY);
-    if (fd < 0) {
-      perror("Error opening file");
-      return 1;
+    if (by_bytes) {
+      k = skip < c->len ? skip : c->len;
+      p += k;
+      skip -= k;
+    } else {
+      while (skip > 0 && (p = memchr(p, '\n', end - p)) != NULL) {
+        p++;
+        skip--;
+      }
+      if (p == NULL)
+        p = end;
     }
+    mb_write(w, p, end - p);
+    head = c->next;
+    free(c);
+  }
+  errno = err;
+  return err ? -1 : 0;
+}
+
+// Print the end of one input, from where it starts in a seekable file or
+// through the chunk list
+static int tail_fd(int fd, int by_bytes, uint64_t count, mb_writer *w) {
+  mb_reader r;
+  struct stat st;
+  off_t size, start;
+  char *p;
+  size_t len;
+  int ret = 0;
 
-    off_t file_size = lseek(fd, 0, SEEK_END);
-    if (file_size < 0) {
-      perror("Error seeking file");
-      close(fd);
-      return 1;
+  size = fstat(fd, &st) == 0 && S_ISREG(st.st_mode) ? lseek(fd, 0, SEEK_END)
+                                                    : -1;
+  if (size < 0)
+    return tail_stream(fd, by_bytes, count, w);
+
+  mb_reader_init(&r, fd);
+  if (by_bytes)
+    start = (uint64_t)size > count ? size - (off_t)count : 0;
+  else
+    start = lines_start(fd, size, count, r.buf);
+  if (start < 0 || lseek(fd, start, SEEK_SET) < 0) {
+    mb_reader_free(&r);
+    return -1;
+  }
+  // Whatever was appended since is printed too
+  while ((p = mb_next_block(&r, &len)) != NULL)
+    mb_write(w, p, len);
+  if (r.error) {
+    errno = r.error;
+    ret = -1;
+  }
+  mb_reader_free(&r);
+  return ret;
+}
+
+// Files followed by -f and -F. A file is watched with inotify, and with
+// -F also its directory so that a new file of the same name is seen. All
+// the watches share one inotify descriptor waited on with epoll. Files
+// without a watch (no inotify, or out of watches) are polled, more often
+// right after data came and less and less often while nothing does.
+#define POLL_MIN_MS 10
+#define POLL_MAX_MS 1000
+
+typedef struct {
+  const char *name;
+  int fd;     // -1 while the file isn't there (-F)
+  int wd;     // inotify watch of the file, -1 if it is polled
+  int dir_wd; // -F, inotify watch of its directory
+  dev_t dev;
+  ino_t ino;
+  off_t pos; // Everything before was printed
+  int dirty; // An event came for it
+} tail_file;
+
+static tail_file *files;
+static int nfollow;
+static int by_name;          // -F, follow the name and not the descriptor
+static int headers;          // Appended data says which file it is from
+static int last_printed = -1; // Index of the file printed last
+static int notify_fd = -1;
+static char *chunk;          // Appended data is read MB_BUFSIZ at a time
+
+static void watch_file(tail_file *f) {
+#ifdef __linux__
+  if (notify_fd < 0)
+    return;
+  if (f->fd >= 0 && f->wd < 0)
+    f->wd = inotify_add_watch(notify_fd, f->name,
+                              IN_MODIFY | IN_ATTRIB | IN_DELETE_SELF |
+                                  IN_MOVE_SELF);
+  if (by_name && f->dir_wd < 0) {
+    size_t len = strlen(f->name);
+    char *dir = memcpy(xmalloc(len + 1), f->name, len + 1);
+
+    f->dir_wd = inotify_add_watch(notify_fd, dirname(dir),
+                                  IN_CREATE | IN_MOVED_TO | IN_ATTRIB);
+    free(dir);
+  }
+#else
+  (void)f;
+#endif
+}
+
+static void unwatch_file(tail_file *f) {
+#ifdef __linux__
+  if (f->wd >= 0)
+    inotify_rm_watch(notify_fd, f->wd);
+#endif
+  f->wd = -1;
+}
+
+// Print what was appended to f since the last time
+static off_t print_new(tail_file *f, mb_writer *w) {
+  off_t total = 0;
+  ssize_t n;
+
+  while ((n = read(f->fd, chunk, MB_BUFSIZ)) != 0) {
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n < 0) {
+      if (errno != EAGAIN)
+        fprintf(stderr, "tail: error reading '%s': %s\n", f->name,
+                strerror(errno));
+      break;
     }
+    if (headers && last_printed != f - files) {
+      mb_write(w, "\n==> ", 5);
+      mb_write(w, f->name, strlen(f->name));
+      mb_write(w, " <==\n", 5);
+      last_printed = f - files;
+    }
+    mb_write(w, chunk, n);
+    f->pos += n;
+    total += n;
+  }
+  return total;
+}
 
-    // For -c and -n options, we need to read from the end of the file
-    if (bytes > 0) {
-      off_t start = file_size > bytes ? file_size - bytes : 0;
-      lseek(fd, start, SEEK_SET);
-      char buffer[bytes];
-      ssize_t n = read(fd, buffer, bytes);
-      if (n < 0) {
-        perror("Error reading file");
-        close(fd);
-        return 1;
-      }
-      write(STDOUT_FILENO, buffer, n);
-    } else if (lines > 0) {
-      // Read the last N lines
-      char *buffer = malloc(file_size);
-      if (!buffer) {
-        perror("Memory allocation error");
-        close(fd);
-        return 1;
-      }
-      lseek(fd, 0, SEEK_SET);
-      ssize_t n = read(fd, buffer, file_size);
-      if (n < 0) {
-        perror("Error reading file");
-        free(buffer);
-        close(fd);
-        return 1;
-      }
+// Something may have happened to f: print what was appended and, with
+// -F, see if the name is gone or now is another file. Returns the bytes
+// printed.
+static off_t check_file(tail_file *f, mb_writer *w) {
+  struct stat st;
+  off_t total = 0;
+  int fd;
 
-      int line_count = 0;
-      for (ssize_t j = n - 1; j >= 0; j--) {
-        if (buffer[j] == '\n') {
-          line_count++;
-          if (line_count >= lines) {
-            write(STDOUT_FILENO, buffer + j + 1, n - j - 1);
-            break;
-          }
-        }
-      }
-      free(buffer);
+  if (f->fd >= 0) {
+    if (fstat(f->fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size < f->pos) {
+      fprintf(stderr, "tail: %s: file truncated\n", f->name);
+      lseek(f->fd, 0, SEEK_SET);
+      f->pos = 0;
+    }
+    total += print_new(f, w);
+  }
+  if (!by_name)
+    return total;
+
+  if (stat(f->name, &st) < 0) {
+    if (f->fd >= 0) {
+      fprintf(stderr, "tail: '%s' has become inaccessible: %s\n", f->name,
+              strerror(errno));
+      close(f->fd);
+      f->fd = -1;
+      unwatch_file(f);
     }
+  } else if ((f->fd < 0 || st.st_dev != f->dev || st.st_ino != f->ino) &&
+             (fd = open(f->name, O_RDONLY | O_NONBLOCK)) >= 0) {
+    // The data left in the old file was printed above
+    fprintf(stderr, "tail: '%s' has %s;  following new file\n", f->name,
+            f->fd < 0 ? "appeared" : "been replaced");
+    if (f->fd >= 0)
+      close(f->fd);
+    unwatch_file(f);
+    fstat(fd, &st);
+    f->fd = fd;
+    f->dev = st.st_dev;
+    f->ino = st.st_ino;
+    f->pos = 0;
+    watch_file(f);
+    total += print_new(f, w);
+  }
+  return total;
+}
 
-    close(fd);
+// Polled files have no watch that would tell about them
+static int is_polled(const tail_file *f) {
+  return notify_fd < 0 || (f->fd >= 0 ? f->wd < 0 : f->dir_wd < 0);
+}
+
+// Wait up to timeout ms (-1 for ever) for inotify events and mark the
+// files they are about
+static void wait_events(int ep, int timeout) {
+#ifdef __linux__
+  char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+  struct epoll_event ev;
+  ssize_t n;
+
+  if (ep < 0 || epoll_wait(ep, &ev, 1, timeout) <= 0) {
+    if (ep < 0)
+      poll(NULL, 0, timeout);
+    return;
+  }
+  while ((n = read(notify_fd, buf, sizeof(buf))) > 0) {
+    for (char *p = buf; p < buf + n;) {
+      struct inotify_event *e = (struct inotify_event *)p;
 
-    if (follow) {
-      // Follow mode: continuously display appended data
-      fd = open(filename, O_RDONLY | O_NONBLOCK);
-      if (fd < 0) {
-        perror("Error reopening file in follow mode");
-        return 1;
+      for (int i = 0; i < nfollow; i++) {
+        if (e->wd == files[i].wd || e->wd == files[i].dir_wd ||
+            (e->mask & IN_Q_OVERFLOW))
+          files[i].dirty = 1;
       }
+      p += sizeof(*e) + e->len;
+    }
+  }
+#else
+  (void)ep;
+  poll(NULL, 0, timeout);
+#endif
+}
+
+// Print what is appended to the files for ever, or until -f has no file
+// left to read
+static int follow_files(mb_writer *w) {
+  int ep = -1, interval = POLL_MIN_MS;
 
-      off_t last_size = lseek(fd, 0, SEEK_END);
-      while (follow) {
-        sleep(1);
-        off_t current_size = lseek(fd, 0, SEEK_END);
-        if (current_size > last_size) {
-          lseek(fd, last_size, SEEK_SET);
-          char buffer[current_size - last_size];
-          ssize_t n = read(fd, buffer, current_size - last_size);
-          if (n > 0) {
-            write(STDOUT_FILENO, buffer, n);
-          }
-          last_size = current_size;
+#ifdef __linux__
+  struct epoll_event ev = {.events = EPOLLIN};
+
+  notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (notify_fd >= 0 && ((ep = epoll_create1(EPOLL_CLOEXEC)) < 0 ||
+                         epoll_ctl(ep, EPOLL_CTL_ADD, notify_fd, &ev) < 0)) {
+    close(notify_fd);
+    notify_fd = -1;
+  }
+#endif
+  chunk = xmalloc(MB_BUFSIZ);
+  for (int i = 0; i < nfollow; i++)
+    watch_file(&files[i]);
+
+  for (;;) {
+    int polled = 0, open_files = 0;
+    off_t got = 0;
+
+    for (int i = 0; i < nfollow; i++) {
+      polled |= is_polled(&files[i]);
+      open_files += files[i].fd >= 0;
+    }
+    if (!by_name && open_files == 0) {
+      fprintf(stderr, "tail: no files remaining\n");
+      return EXIT_FAILURE;
+    }
+    wait_events(ep, polled ? interval : -1);
+    for (int i = 0; i < nfollow; i++) {
+      if (files[i].dirty || is_polled(&files[i]))
+        got += check_file(&files[i], w);
+      files[i].dirty = 0;
+    }
+    if (mb_flush(w) < 0) {
+      errno = w->error;
+      perror("tail: error writing 'standard output'");
+      return EXIT_FAILURE;
+    }
+    interval = got ? POLL_MIN_MS : interval * 2;
+    if (interval > POLL_MAX_MS)
+      interval = POLL_MAX_MS;
+  }
+}
+
+// NUM of -n and -c, all digits
+static int parse_count(const char *arg, uint64_t *count) {
+  char *end;
+
+  if (arg == NULL || !isdigit((unsigned char)*arg))
+    return -1;
+  errno = 0;
+  *count = strtoull(arg, &end, 10);
+  return errno || *end ? -1 : 0;
+}
+
+int tail(int argc, char *argv[]) {
+  mb_writer w;
+  uint64_t count = DEFAULT_LINES;
+  int by_bytes = 0, follow = 0, nfiles = 0, only_files = 0;
+  int ret = EXIT_SUCCESS;
+
+  // Options can come anywhere, the files are packed at the start of argv
+  for (int i = 1; i < argc; i++) {
+    char *arg = argv[i];
+
+    if (only_files || arg[0] != '-' || arg[1] == '\0') {
+      argv[nfiles++] = arg;
+      continue;
+    }
+    if (strcmp(arg, "--") == 0) {
+      only_files = 1;
+      continue;
+    }
+    for (int j = 1; arg[j]; j++) {
+      if (arg[j] == 'f' || arg[j] == 'F') {
+        follow = 1;
+        by_name |= arg[j] == 'F';
+      } else if (arg[j] == 'n' || arg[j] == 'c') {
+        // -n NUM or -nNUM
+        const char *num = arg[j + 1] ? arg + j + 1 : argv[++i];
+
+        by_bytes = arg[j] == 'c';
+        if (parse_count(i < argc ? num : NULL, &count) < 0) {
+          fprintf(stderr, "tail: invalid number of %s: '%s'\n",
+                  by_bytes ? "bytes" : "lines", i < argc ? num : "");
+          return EXIT_FAILURE;
         }
+        break;
+      } else {
+        fprintf(stderr, "tail: invalid option -- '%c'\n", arg[j]);
+        fprintf(stderr, "Usage: tail [-c NUM] [-n NUM] [-f|-F] [file...]\n");
+        return EXIT_FAILURE;
       }
-      close(fd);
     }
   }
+  select_kernel();
 
-  return 0;
+  mb_writer_init(&w, STDOUT_FILENO);
+  // Like other tails, a pipe on stdin isn't followed
+  if (follow && nfiles > 0)
+    files = xzalloc(nfiles * sizeof(*files));
+  headers = nfiles > 1;
+  if (nfiles == 0) {
+    if (tail_fd(STDIN_FILENO, by_bytes, count, &w) < 0) {
+      perror("tail: error reading 'standard input'");
+      ret = EXIT_FAILURE;
+    }
+  }
+  for (int i = 0; i < nfiles; i++) {
+    int fd = open(argv[i], O_RDONLY);
+    struct stat st;
+
+    if (fd < 0) {
+      fprintf(stderr, "tail: cannot open '%s' for reading: %s\n", argv[i],
+              strerror(errno));
+      ret = EXIT_FAILURE;
+    } else {
+      // Several files each get a header
+      if (headers) {
+        const char *sep = last_printed >= 0 ? "\n==> " : "==> ";
+
+        mb_write(&w, sep, strlen(sep));
+        mb_write(&w, argv[i], strlen(argv[i]));
+        mb_write(&w, " <==\n", 5);
+        last_printed = nfollow;
+      }
+      if (tail_fd(fd, by_bytes, count, &w) < 0) {
+        fprintf(stderr, "tail: error reading '%s': %s\n", argv[i],
+                strerror(errno));
+        ret = EXIT_FAILURE;
+      }
+    }
+    if (!files) {
+      if (fd >= 0)
+        close(fd);
+      continue;
+    }
+    // Followed from where the output stopped. -f drops the files it can't
+    // read, -F waits for them to show up.
+    if (fd < 0 && !by_name)
+      continue;
+    files[nfollow].name = argv[i];
+    files[nfollow].fd = fd;
+    files[nfollow].wd = files[nfollow].dir_wd = -1;
+    if (fd >= 0 && fstat(fd, &st) == 0) {
+      files[nfollow].dev = st.st_dev;
+      files[nfollow].ino = st.st_ino;
+      files[nfollow].pos = lseek(fd, 0, SEEK_CUR);
+    }
+    nfollow++;
+  }
+  if (files) {
+    if (mb_flush(&w) == 0)
+      ret = follow_files(&w);
+  }
+  if (mb_writer_free(&w) < 0 || w.error) {
+    errno = w.error;
+    perror("tail: error writing 'standard output'");
+    return EXIT_FAILURE;
+  }
+  return ret;
 }
@@ -20,36 +20,498 @@
  */
 
 #include "minibox.h"
+#include "libmb.h"
 
-/* tr program */
-int tr(int argc, char *argv[]) {
-  if (argc != 4) {
-    fprintf(stderr, "Usage: %s SET1 SET2\n", argv[0]);
-    return EXIT_FAILURE;
+#include <ctype.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define TR_X86 1
+#endif
+
+// Most high nibbles the vector translation handles, a table changing
+// bytes all over is faster with the plain lookup
+#define MAX_VECTOR_NIBBLES 8
+
+// A set operand expanded to its bytes. In SET2 a [c*] repeat is left for
+// later, it takes whatever SET1 has more.
+typedef struct {
+  unsigned char *c;
+  size_t len, cap;
+  long fill_at; // Index of the [c*] repeat, -1 if none
+  unsigned char fill;
+} tr_set;
+
+// Bytes to delete or to squeeze, as a table and as the bit masks of the
+// vector kernels: bit h of lo[l] (hi[l] for h >= 8) is byte h*16+l
+typedef struct {
+  unsigned char has[256];
+  unsigned char lo[16], hi[16];
+} byte_set;
+
+static unsigned char table[256];     // Translation
+static unsigned char nibbles[16];    // High nibbles table changes
+static unsigned char deltas[16][16]; // What table adds, by nibble
+static int nnibbles;
+static byte_set delete_set, squeeze_set;
+static int last = -1; // Last byte written if it is one to squeeze
+
+static void set_add(tr_set *s, unsigned char c) {
+  if (s->len == s->cap) {
+    s->cap = s->cap ? s->cap * 2 : 64;
+    s->c = xrealloc(s->c, s->cap);
   }
+  s->c[s->len++] = c;
+}
 
-  const char *set1 = argv[1];
-  const char *set2 = argv[2];
-  if (strlen(set1) != strlen(set2)) {
-    fprintf(stderr, "SET1 and SET2 must be of the same length.\n");
-    return EXIT_FAILURE;
+// Character classes, all bytes in the C locale
+static int class_match(const char *name, size_t len, int c) {
+  static const struct {
+    const char *name;
+    int (*match)(int);
+  } classes[] = {
+      {"alnum", isalnum}, {"alpha", isalpha}, {"blank", isblank},
+      {"cntrl", iscntrl}, {"digit", isdigit}, {"graph", isgraph},
+      {"lower", islower}, {"print", isprint}, {"punct", ispunct},
+      {"space", isspace}, {"upper", isupper}, {"xdigit", isxdigit},
+  };
+
+  for (size_t i = 0; i < sizeof(classes) / sizeof(classes[0]); i++) {
+    if (strlen(classes[i].name) == len &&
+        memcmp(classes[i].name, name, len) == 0)
+      return classes[i].match(c) != 0;
+  }
+  return -1;
+}
+
+// One character of a set at *s, with the backslash escapes
+static unsigned char next_char(const char **s) {
+  const char *p = *s;
+  int c = (unsigned char)*p++;
+
+  if (c == '\\' && *p) {
+    c = (unsigned char)*p++;
+    switch (c) {
+    case 'a': c = '\a'; break;
+    case 'b': c = '\b'; break;
+    case 'f': c = '\f'; break;
+    case 'n': c = '\n'; break;
+    case 'r': c = '\r'; break;
+    case 't': c = '\t'; break;
+    case 'v': c = '\v'; break;
+    default:
+      if (c >= '0' && c <= '7') {
+        c -= '0';
+        for (int i = 0; i < 2 && *p >= '0' && *p <= '7'; i++)
+          c = c * 8 + *p++ - '0';
+      }
+    }
+  }
+  *s = p;
+  return c;
+}
+
+// Expand a set operand: characters and escapes, ranges like a-z, classes
+// like [:upper:], [=c=] and in SET2 the [c*n] repeats. Returns -1 and
+// reports a bad one.
+static int parse_set(const char *arg, int is_set2, tr_set *s) {
+  const char *p = arg;
+
+  s->fill_at = -1;
+  while (*p) {
+    const char *close;
+    unsigned char c;
+
+    if (p[0] == '[' && (p[1] == ':' || p[1] == '=') &&
+        (close = strstr(p + 2, p[1] == ':' ? ":]" : "=]")) != NULL) {
+      if (p[1] == '=') {
+        const char *q = p + 2;
+
+        c = next_char(&q);
+        if (q != close) {
+          fprintf(stderr, "tr: %.*s: equivalence class operand must be a "
+                          "single character\n", (int)(close - p - 2), p + 2);
+          return -1;
+        }
+        set_add(s, c);
+      } else {
+        if (class_match(p + 2, close - p - 2, 0) < 0) {
+          fprintf(stderr, "tr: invalid character class '%.*s'\n",
+                  (int)(close - p - 2), p + 2);
+          return -1;
+        }
+        for (int b = 0; b < 256; b++) {
+          if (class_match(p + 2, close - p - 2, b))
+            set_add(s, b);
+        }
+      }
+      p = close + 2;
+      continue;
+    }
+    if (is_set2 && p[0] == '[' && p[1]) {
+      // [c*n] is c n times, [c*] as many as needed
+      const char *q = p + 1;
+      char *end;
+
+      c = next_char(&q);
+      if (q[0] == '*' && (close = strchr(q, ']')) != NULL) {
+        unsigned long n = strtoul(q + 1, &end, q[1] == '0' ? 8 : 10);
+
+        if (end != close) {
+          fprintf(stderr, "tr: invalid repeat count '%.*s' in [c*n] "
+                          "construct\n", (int)(close - q - 1), q + 1);
+          return -1;
+        }
+        if (n == 0) {
+          s->fill_at = s->len;
+          s->fill = c;
+        }
+        while (n-- > 0)
+          set_add(s, c);
+        p = close + 1;
+        continue;
+      }
+    }
+    c = next_char(&p);
+    if (p[0] == '-' && p[1]) {
+      unsigned char hi;
+
+      p++;
+      hi = next_char(&p);
+      if (hi < c) {
+        fprintf(stderr, "tr: range-endpoints of '%c-%c' are in reverse "
+                        "collating sequence order\n", c, hi);
+        return -1;
+      }
+      for (int b = c; b <= hi; b++)
+        set_add(s, b);
+      continue;
+    }
+    set_add(s, c);
+  }
+  return 0;
+}
+
+static void byte_set_init(byte_set *set, const tr_set *s, int complement) {
+  memset(set, 0, sizeof(*set));
+  for (size_t i = 0; i < s->len; i++)
+    set->has[s->c[i]] = 1;
+  for (int b = 0; b < 256; b++) {
+    set->has[b] ^= complement;
+    if (set->has[b] && b < 128)
+      set->lo[b & 15] |= 1 << (b >> 4);
+    else if (set->has[b])
+      set->hi[b & 15] |= 1 << ((b >> 4) - 8);
+  }
+}
+
+// Scalar kernels, also used for the bytes the vector ones leave over. The
+// block is changed in place, the ones dropping bytes return what is left.
+static void translate_scalar(unsigned char *p, size_t len) {
+  size_t i = 0;
+
+  for (; i + 4 <= len; i += 4) {
+    p[i] = table[p[i]];
+    p[i + 1] = table[p[i + 1]];
+    p[i + 2] = table[p[i + 2]];
+    p[i + 3] = table[p[i + 3]];
+  }
+  for (; i < len; i++)
+    p[i] = table[p[i]];
+}
+
+static size_t delete_scalar(unsigned char *p, size_t i, size_t len,
+                            size_t out) {
+  for (; i < len; i++) {
+    p[out] = p[i];
+    out += !delete_set.has[p[i]];
+  }
+  return out;
+}
+
+// Moves p[i..len) to p[out..] without the repeats of squeeze_set bytes
+static size_t squeeze_scalar(unsigned char *p, size_t i, size_t len,
+                             size_t out) {
+  for (; i < len; i++) {
+    if (p[i] == last)
+      continue;
+    p[out++] = p[i];
+    last = squeeze_set.has[p[i]] ? p[i] : -1;
+  }
+  return out;
+}
+
+#ifdef TR_X86
+// The vector kernels split each byte in its nibbles. A byte is in a set
+// if the bit of its high nibble is set in the mask the low nibble picks,
+// both looked up with shuffles. The translation adds to each byte the
+// delta its low nibble picks out of the table of its high nibble, for the
+// few high nibbles the table changes at all.
+__attribute__((target("avx2"))) static inline __m256i
+set_members(__m256i v, __m256i lo, __m256i hi) {
+  const __m256i bits = _mm256_setr_epi8(
+      1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128, 1, 2, 4, 8,
+      16, 32, 64, -128, 1, 2, 4, 8, 16, 32, 64, -128);
+  __m256i high = _mm256_and_si256(_mm256_srli_epi16(v, 4),
+                                  _mm256_set1_epi8(0x0f));
+  // Shuffles give 0 for index bytes with the top bit set
+  __m256i mask = _mm256_or_si256(
+      _mm256_shuffle_epi8(lo, v),
+      _mm256_shuffle_epi8(hi, _mm256_xor_si256(v, _mm256_set1_epi8(-128))));
+  __m256i bit = _mm256_shuffle_epi8(bits, high);
+
+  return _mm256_cmpeq_epi8(_mm256_and_si256(mask, bit), bit);
+}
+
+__attribute__((target("avx2"))) static void
+translate_avx2(unsigned char *p, size_t len) {
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  __m256i delta[16], nibble[16];
+  size_t i = 0;
+
+  for (int k = 0; k < nnibbles; k++) {
+    delta[k] = _mm256_broadcastsi128_si256(
+        _mm_loadu_si128((const __m128i *)deltas[k]));
+    nibble[k] = _mm256_set1_epi8(nibbles[k]);
   }
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    __m256i low = _mm256_and_si256(v, low_mask);
+    __m256i high = _mm256_and_si256(_mm256_srli_epi16(v, 4), low_mask);
+    __m256i r = v;
 
-  // Create a translation table
-  int translate[256];
-  for (int i = 0; i < 256; ++i) {
-    translate[i] = i; // Default to no translation
+    for (int k = 0; k < nnibbles; k++) {
+      __m256i d = _mm256_shuffle_epi8(delta[k], low);
+
+      r = _mm256_add_epi8(
+          r, _mm256_and_si256(d, _mm256_cmpeq_epi8(high, nibble[k])));
+    }
+    _mm256_storeu_si256((__m256i *)(p + i), r);
   }
+  translate_scalar(p + i, len - i);
+}
 
-  for (size_t i = 0; i < strlen(set1); ++i) {
-    translate[(unsigned char)set1[i]] = (unsigned char)set2[i];
+__attribute__((target("avx2"))) static __m256i load_mask(
+    const unsigned char *mask) {
+  return _mm256_broadcastsi128_si256(_mm_loadu_si128((const __m128i *)mask));
+}
+
+// Vectors without a byte to drop move as a whole, the others byte by byte.
+// The output never gets ahead of the input, the vector is loaded before.
+__attribute__((target("avx2"))) static size_t
+delete_avx2(unsigned char *p, size_t i, size_t len, size_t out) {
+  __m256i lo = load_mask(delete_set.lo), hi = load_mask(delete_set.hi);
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+
+    if (_mm256_movemask_epi8(set_members(v, lo, hi)) == 0) {
+      _mm256_storeu_si256((__m256i *)(p + out), v);
+      out += 32;
+    } else {
+      out = delete_scalar(p, i, i + 32, out);
+    }
   }
+  return delete_scalar(p, i, len, out);
+}
+
+// Only a byte of the set equal to the one before is dropped, the vector
+// shifted by a byte gives the one before for all but the first
+__attribute__((target("avx2"))) static size_t
+squeeze_avx2(unsigned char *p, size_t i, size_t len, size_t out) {
+  __m256i lo = load_mask(squeeze_set.lo), hi = load_mask(squeeze_set.hi);
 
-  // Read from standard input (or file if provided)
-  int c;
-  while ((c = getchar()) != EOF) {
-    putchar(translate[c]);
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    __m256i before = _mm256_alignr_epi8(
+        v, _mm256_permute2x128_si256(v, v, 0x08), 15);
+    __m256i members = set_members(v, lo, hi);
+    unsigned repeats = _mm256_movemask_epi8(
+        _mm256_and_si256(members, _mm256_cmpeq_epi8(v, before)));
+
+    if ((repeats & ~1u) == 0 && p[i] != last) {
+      last = _mm256_movemask_epi8(members) >> 31 ? p[i + 31] : -1;
+      _mm256_storeu_si256((__m256i *)(p + out), v);
+      out += 32;
+    } else {
+      out = squeeze_scalar(p, i, i + 32, out);
+    }
+  }
+  return squeeze_scalar(p, i, len, out);
+}
+#endif
+
+static void (*translate_block)(unsigned char *p, size_t len) =
+    translate_scalar;
+static size_t (*delete_block)(unsigned char *p, size_t i, size_t len,
+                              size_t out) = delete_scalar;
+static size_t (*squeeze_block)(unsigned char *p, size_t i, size_t len,
+                               size_t out) = squeeze_scalar;
+
+// Pick the kernels for the CPU running us and for the table
+static void select_kernels(void) {
+  nnibbles = 0;
+  for (int h = 0; h < 16; h++) {
+    int changed = 0;
+
+    for (int l = 0; l < 16; l++) {
+      deltas[nnibbles][l] = table[h * 16 + l] - (h * 16 + l);
+      changed |= deltas[nnibbles][l];
+    }
+    if (changed)
+      nibbles[nnibbles++] = h;
+  }
+#ifdef TR_X86
+  if (mb_simd_level() == MB_SIMD_AVX2) {
+    if (nnibbles <= MAX_VECTOR_NIBBLES)
+      translate_block = translate_avx2;
+    delete_block = delete_avx2;
+    squeeze_block = squeeze_avx2;
   }
+#endif
+}
+
+static void usage(void) {
+  fprintf(stderr, "Usage: tr [-cdst] SET1 [SET2]\n");
+}
 
+int tr(int argc, char *argv[]) {
+  tr_set sets[2] = {{0}};
+  int complement = 0, delete = 0, squeeze = 0, truncate = 0, nsets = 0;
+  int only_sets = 0, translate;
+  mb_reader r;
+  mb_writer w;
+  char *p;
+  size_t len;
+
+  for (int i = 1; i < argc; i++) {
+    char *arg = argv[i];
+
+    if (only_sets || arg[0] != '-' || arg[1] == '\0') {
+      if (nsets == 2) {
+        fprintf(stderr, "tr: extra operand '%s'\n", arg);
+        usage();
+        return EXIT_FAILURE;
+      }
+      argv[nsets++] = arg;
+      continue;
+    }
+    if (strcmp(arg, "--") == 0) {
+      only_sets = 1;
+      continue;
+    }
+    for (int j = 1; arg[j]; j++) {
+      switch (arg[j]) {
+      case 'c':
+      case 'C':
+        complement = 1;
+        break;
+      case 'd':
+        delete = 1;
+        break;
+      case 's':
+        squeeze = 1;
+        break;
+      case 't':
+        truncate = 1;
+        break;
+      default:
+        fprintf(stderr, "tr: invalid option -- '%c'\n", arg[j]);
+        usage();
+        return EXIT_FAILURE;
+      }
+    }
+  }
+  // -d and -s alone take one set, -d -s and translating take two
+  translate = !delete && (nsets == 2 || !squeeze);
+  if (nsets < 1 + (translate || (delete && squeeze))) {
+    fprintf(stderr, "tr: missing operand\n");
+    usage();
+    return EXIT_FAILURE;
+  }
+  if (delete && !squeeze && nsets == 2) {
+    fprintf(stderr, "tr: extra operand '%s'\n", argv[1]);
+    usage();
+    return EXIT_FAILURE;
+  }
+  for (int i = 0; i < nsets; i++) {
+    if (parse_set(argv[i], i == 1, &sets[i]) < 0)
+      return EXIT_FAILURE;
+  }
+
+  if (translate) {
+    tr_set *s1 = &sets[0], *s2 = &sets[1];
+    tr_set from = {0};
+
+    // The complement of SET1 is its missing bytes in ascending order
+    if (complement) {
+      byte_set_init(&delete_set, s1, 1);
+      for (int b = 0; b < 256; b++) {
+        if (delete_set.has[b])
+          set_add(&from, b);
+      }
+      memset(&delete_set, 0, sizeof(delete_set));
+      s1 = &from;
+    }
+    // [c*] in SET2 repeats c as needed to make it as long as SET1
+    if (s2->fill_at >= 0 && s2->len < s1->len) {
+      size_t n = s1->len - s2->len, tail = s2->len - s2->fill_at;
+
+      for (size_t i = 0; i < n; i++)
+        set_add(s2, 0);
+      memmove(s2->c + s2->fill_at + n, s2->c + s2->fill_at, tail);
+      memset(s2->c + s2->fill_at, s2->fill, n);
+    }
+    if (truncate && s1->len > s2->len)
+      s1->len = s2->len;
+    if (s2->len == 0 && s1->len > 0) {
+      fprintf(stderr, "tr: when not truncating set1, string2 must be "
+                      "non-empty\n");
+      return EXIT_FAILURE;
+    }
+    for (int b = 0; b < 256; b++)
+      table[b] = b;
+    // A shorter SET2 goes on with its last byte
+    for (size_t i = 0; i < s1->len; i++)
+      table[s1->c[i]] = s2->c[i < s2->len ? i : s2->len - 1];
+    free(from.c);
+  }
+  if (delete)
+    byte_set_init(&delete_set, &sets[0], complement);
+  if (squeeze)
+    byte_set_init(&squeeze_set, &sets[nsets - 1],
+                  complement && nsets == 1);
+  select_kernels();
+
+  // Standard input a block at a time, changed in place in the read buffer
+  mb_reader_init(&r, STDIN_FILENO);
+  mb_writer_init(&w, STDOUT_FILENO);
+  while ((p = mb_next_block(&r, &len)) != NULL) {
+    unsigned char *u = (unsigned char *)p;
+
+    if (delete)
+      len = delete_block(u, 0, len, 0);
+    else if (translate)
+      translate_block(u, len);
+    if (squeeze)
+      len = squeeze_block(u, 0, len, 0);
+    if (mb_write(&w, p, len) < 0)
+      break;
+  }
+  free(sets[0].c);
+  free(sets[1].c);
+  if (mb_writer_free(&w) < 0) {
+    errno = w.error;
+    perror("tr: write error");
+    mb_reader_free(&r);
+    return EXIT_FAILURE;
+  }
+  if (r.error) {
+    errno = r.error;
+    perror("tr: read error");
+    mb_reader_free(&r);
+    return EXIT_FAILURE;
+  }
+  mb_reader_free(&r);
   return EXIT_SUCCESS;
 }
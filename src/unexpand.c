@@ -20,12 +20,24 @@
  */
 
 #include "minibox.h"
+#include "libmb.h"
 
 #define DEFAULT_TAB_WIDTH 8
 
+// Output a run of `count` spaces, as tabs and spaces if `to_tabs` is set
+static void put_space_run(mb_writer *w, int count, int tab_width,
+                          bool to_tabs) {
+  if (to_tabs) {
+    for (int i = 0; i < count / tab_width; i++)
+      mb_putc(w, '\t');
+    count %= tab_width;
+  }
+  for (int i = 0; i < count; i++)
+    mb_putc(w, ' ');
+}
+
 int unexpand(int argc, char *argv[]) {
-  FILE *input = stdin;
-  FILE *output = stdout;
+  int input = STDIN_FILENO;
   int tab_width = DEFAULT_TAB_WIDTH;
   bool convert_all_spaces = false;
   bool skip_form_feed = false;
@@ -39,64 +51,56 @@ int unexpand(int argc, char *argv[]) {
     } else if (argv[i][0] == '-' && argv[i][1] == 'f') {
       skip_form_feed = true;
     } else {
-      input = fopen(argv[i], "r");
-      if (!input) {
+      input = open(argv[i], O_RDONLY);
+      if (input < 0) {
         perror("Error opening input file");
         return 1;
       }
     }
   }
 
-  int c;
+  if (tab_width < 1)
+    tab_width = DEFAULT_TAB_WIDTH;
+
+  mb_reader r;
+  mb_writer w;
+  char *p;
+  size_t len;
   int space_count = 0;
 
-  while ((c = fgetc(input)) != EOF) {
-    if (c == ' ') {
-      space_count++;
-    } else {
+  mb_reader_init(&r, input);
+  mb_writer_init(&w, STDOUT_FILENO);
+  while ((p = mb_next_block(&r, &len)) != NULL) {
+    for (size_t i = 0; i < len; i++) {
+      char c = p[i];
+
+      if (c == ' ') {
+        space_count++;
+        continue;
+      }
       if (space_count > 0) {
-        if (skip_form_feed && (c == '\f')) {
-          fputc(c, output);
-        } else {
-          if (convert_all_spaces) {
-            int tabs = space_count / tab_width;
-            int spaces = space_count % tab_width;
-            for (int i = 0; i < tabs; i++)
-              fputc('\t', output);
-            for (int i = 0; i < spaces; i++)
-              fputc(' ', output);
-          } else {
-            for (int i = 0; i < space_count; i++)
-              fputc(' ', output);
-          }
-        }
+        if (skip_form_feed && c == '\f')
+          mb_putc(&w, c);
+        else
+          put_space_run(&w, space_count, tab_width, convert_all_spaces);
         space_count = 0;
       }
-      fputc(c, output);
+      mb_putc(&w, c);
     }
   }
 
   // Handle remaining spaces
   if (space_count > 0) {
-    if (skip_form_feed) {
-      fputc(' ', output);
-    } else {
-      if (convert_all_spaces) {
-        int tabs = space_count / tab_width;
-        int spaces = space_count % tab_width;
-        for (int i = 0; i < tabs; i++)
-          fputc('\t', output);
-        for (int i = 0; i < spaces; i++)
-          fputc(' ', output);
-      } else {
-        for (int i = 0; i < space_count; i++)
-          fputc(' ', output);
-      }
-    }
+    if (skip_form_feed)
+      mb_putc(&w, ' ');
+    else
+      put_space_run(&w, space_count, tab_width, convert_all_spaces);
   }
 
-  if (input != stdin)
-    fclose(input);
+  mb_writer_free(&w);
+  mb_reader_free(&r);
+  if (input != STDIN_FILENO)
+    close(input);
 
   return 0;
 }
@@ -20,124 +20,451 @@
  */
 
 #include "minibox.h"
+#include "libmb.h"
+
+#include <pthread.h>
+#include <sys/stat.h>
+
+#define MAX_THREADS 64
+#define MIN_RANGE_SIZE (8 * 1024 * 1024) // Smallest byte range per thread
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define WC_X86 1
+#endif
+
+typedef struct {
+  unsigned long long lines, words, chars, bytes, max_line;
+} wc_counts;
+
+// Words are separated by the C locale isspace() characters
+static int is_blank(unsigned char c) { return c == ' ' || (c - 9u) <= 4; }
+
+// Portable kernel, also used for the tails the vector kernels leave over.
+// `prev_blank` tells if the byte before the block was a blank. Characters
+// are UTF-8 ones, every byte but the 10xxxxxx continuation bytes starts one.
+static void count_scalar(const unsigned char *p, size_t len, wc_counts *c,
+                         int *prev_blank) {
+  int blank = *prev_blank;
+
+  for (size_t i = 0; i < len; i++) {
+    int b = is_blank(p[i]);
+
+    c->lines += p[i] == '\n';
+    c->words += blank && !b;
+    c->chars += (p[i] & 0xc0) != 0x80;
+    blank = b;
+  }
+  *prev_blank = blank;
+}
+
+#ifdef WC_X86
+// Both vector kernels build a bit mask of newlines, one of blanks and one of
+// character starts per vector, a word starts at every non blank byte
+// following a blank one. As signed bytes the continuation bytes are the
+// ones from -128 to -65.
+__attribute__((target("sse2"))) static void
+count_sse2(const unsigned char *p, size_t len, wc_counts *c, int *prev_blank) {
+  const __m128i nl = _mm_set1_epi8('\n'), sp = _mm_set1_epi8(' ');
+  const __m128i tab = _mm_set1_epi8(9), four = _mm_set1_epi8(4);
+  const __m128i cont = _mm_set1_epi8(-65);
+  unsigned prev = *prev_blank;
+  size_t i = 0;
+
+  for (; i + 16 <= len; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+    __m128i ctl = _mm_sub_epi8(v, tab); // \t to \r become 0 to 4
+    __m128i blank = _mm_or_si128(_mm_cmpeq_epi8(v, sp),
+                                 _mm_cmpeq_epi8(_mm_min_epu8(ctl, four), ctl));
+    unsigned nlm = _mm_movemask_epi8(_mm_cmpeq_epi8(v, nl));
+    unsigned bm = _mm_movemask_epi8(blank);
+    unsigned cm = _mm_movemask_epi8(_mm_cmpgt_epi8(v, cont));
+
+    c->lines += __builtin_popcount(nlm);
+    c->chars += __builtin_popcount(cm);
+    c->words += __builtin_popcount(~bm & (bm << 1 | prev) & 0xffff);
+    prev = bm >> 15;
+  }
+  *prev_blank = prev;
+  count_scalar(p + i, len - i, c, prev_blank);
+}
+
+__attribute__((target("avx2,popcnt"))) static void
+count_avx2(const unsigned char *p, size_t len, wc_counts *c, int *prev_blank) {
+  const __m256i nl = _mm256_set1_epi8('\n'), sp = _mm256_set1_epi8(' ');
+  const __m256i tab = _mm256_set1_epi8(9), four = _mm256_set1_epi8(4);
+  const __m256i cont = _mm256_set1_epi8(-65);
+  unsigned prev = *prev_blank;
+  size_t i = 0;
+
+  for (; i + 32 <= len; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i *)(p + i));
+    __m256i ctl = _mm256_sub_epi8(v, tab);
+    __m256i blank =
+        _mm256_or_si256(_mm256_cmpeq_epi8(v, sp),
+                        _mm256_cmpeq_epi8(_mm256_min_epu8(ctl, four), ctl));
+    unsigned nlm = _mm256_movemask_epi8(_mm256_cmpeq_epi8(v, nl));
+    unsigned bm = _mm256_movemask_epi8(blank);
+    unsigned cm = _mm256_movemask_epi8(_mm256_cmpgt_epi8(v, cont));
+
+    c->lines += __builtin_popcount(nlm);
+    c->chars += __builtin_popcount(cm);
+    c->words += __builtin_popcount(~bm & (bm << 1 | prev));
+    prev = bm >> 31;
+  }
+  *prev_blank = prev;
+  count_scalar(p + i, len - i, c, prev_blank);
+}
+#endif
+
+// Display width of the lines for -L, tabs go to the next multiple of 8 and
+// carriage returns and form feeds start over like newlines do
+static void max_line_scalar(const unsigned char *p, size_t len,
+                            unsigned long long *col, wc_counts *c) {
+  for (size_t i = 0; i < len; i++) {
+    if (p[i] == '\n' || p[i] == '\r' || p[i] == '\f') {
+      if (*col > c->max_line)
+        c->max_line = *col;
+      *col = 0;
+    } else if (p[i] == '\t') {
+      *col = (*col + 8) & ~7ULL;
+    } else if ((p[i] & 0xc0) != 0x80 && p[i] >= ' ' && p[i] != 0x7f) {
+      (*col)++;
+    }
+  }
+}
+
+typedef void (*count_func)(const unsigned char *, size_t, wc_counts *, int *);
+
+static count_func count_block;
+static int num_threads = 1;
+static int want_max_line;
+
+// A byte range of a file counted on its own thread with pread. Whether it
+// starts and ends with a blank is kept to join words split by the seams.
+typedef struct {
+  int fd;
+  off_t start, end;
+  wc_counts c;
+  int first_blank, last_blank;
+  int error;
+} wc_range;
+
+// Files of the argument list, counted concurrently but printed in order
+typedef struct {
+  const char *name;
+  wc_counts c;
+  int ret;
+  int done;
+} wc_file;
+
+// Pick the widest kernel the CPU running us supports
+static count_func select_kernel(void) {
+#ifdef WC_X86
+  if (mb_simd_level() == MB_SIMD_AVX2)
+    return count_avx2;
+  if (mb_simd_level() == MB_SIMD_SSE2)
+    return count_sse2;
+#endif
+  return count_scalar;
+}
+
+static void *count_range(void *arg) {
+  wc_range *rg = arg;
+  char *buf = xmalloc(MB_BUFSIZ);
+  off_t pos = rg->start;
+  int prev_blank = 1;
+
+  rg->first_blank = 1;
+  while (pos < rg->end) {
+    size_t want = rg->end - pos < MB_BUFSIZ ? rg->end - pos : MB_BUFSIZ;
+    ssize_t n = pread(rg->fd, buf, want, pos);
+
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0) {
+      rg->error = n < 0 ? errno : 0;
+      break;
+    }
+    if (pos == rg->start)
+      rg->first_blank = is_blank(buf[0]);
+    rg->c.bytes += n;
+    count_block((const unsigned char *)buf, n, &rg->c, &prev_blank);
+    pos += n;
+  }
+  rg->last_blank = prev_blank;
+  free(buf);
+  return NULL;
+}
+
+// Split a regular file into one byte range per thread. Every range counts
+// a word where it starts with a non blank, which is one too many when the
+// range before it ended in the middle of that word.
+static int count_ranges(int fd, off_t size, int n, wc_counts *c) {
+  wc_range ranges[MAX_THREADS];
+  pthread_t tids[MAX_THREADS];
+  int started[MAX_THREADS] = {0};
+  int error = 0;
+
+  for (int i = 0; i < n; i++)
+    ranges[i] = (wc_range){.fd = fd, .start = size * i / n,
+                           .end = size * (i + 1) / n};
+  for (int i = 1; i < n; i++)
+    started[i] = pthread_create(&tids[i], NULL, count_range, &ranges[i]) == 0;
+  count_range(&ranges[0]);
+
+  for (int i = 0; i < n; i++) {
+    if (i > 0 && started[i])
+      pthread_join(tids[i], NULL);
+    else if (i > 0)
+      count_range(&ranges[i]);
+
+    c->lines += ranges[i].c.lines;
+    c->words += ranges[i].c.words;
+    c->chars += ranges[i].c.chars;
+    c->bytes += ranges[i].c.bytes;
+    if (i > 0 && !ranges[i - 1].last_blank && !ranges[i].first_blank)
+      c->words--;
+    if (ranges[i].error)
+      error = ranges[i].error;
+  }
+  if (error)
+    errno = error;
+  return error ? -1 : 0;
+}
+
+// Count a whole descriptor a block at a time. When only the byte count of a
+// regular file is wanted, the size accounts for all but its last block. That
+// block is still read, files in /proc and /sys report a size of 0 or of one
+// page whatever they hold. Big regular files are split between `threads`
+// threads.
+static int count_fd(int fd, const char *name, int bytes_only, int threads,
+                    wc_counts *c) {
+  struct stat st;
+  mb_reader r;
+  char *p;
+  size_t len;
+  int prev_blank = 1;
+  unsigned long long col = 0;
+
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    off_t pos = lseek(fd, 0, SEEK_CUR);
+
+    if (bytes_only) {
+      off_t skip = st.st_size - st.st_size % ((off_t)st.st_blksize + 1);
+
+      if (pos >= 0 && pos < skip && lseek(fd, skip, SEEK_SET) >= 0)
+        c->bytes = skip - pos;
+    } else if (pos == 0 && threads > 1 && !want_max_line &&
+               st.st_size >= 2 * MIN_RANGE_SIZE) {
+      // -L needs whole lines, so no splitting for it
+      if (threads > st.st_size / MIN_RANGE_SIZE)
+        threads = st.st_size / MIN_RANGE_SIZE;
+      if (count_ranges(fd, st.st_size, threads, c) < 0) {
+        perror(name);
+        return -1;
+      }
+      return 0;
+    }
+  }
+
+  mb_reader_init(&r, fd);
+  while ((p = mb_next_block(&r, &len)) != NULL) {
+    c->bytes += len;
+    if (bytes_only)
+      continue;
+    count_block((const unsigned char *)p, len, c, &prev_blank);
+    if (want_max_line)
+      max_line_scalar((const unsigned char *)p, len, &col, c);
+  }
+  if (col > c->max_line)
+    c->max_line = col;
+  mb_reader_free(&r);
+  if (r.error) {
+    errno = r.error;
+    perror(name);
+    return -1;
+  }
+  return 0;
+}
+
+static int count_path(const char *name, int bytes_only, int threads,
+                      wc_counts *c) {
+  int fd = strcmp(name, "-") == 0 ? STDIN_FILENO : open(name, O_RDONLY);
+  int ret;
+
+  if (fd < 0) {
+    perror(name);
+    return -1;
+  }
+  ret = count_fd(fd, name, bytes_only, threads, c);
+  if (fd != STDIN_FILENO)
+    close(fd);
+  return ret;
+}
+
+static pthread_mutex_t files_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t files_done = PTHREAD_COND_INITIALIZER;
+static wc_file *files;
+static int num_files, next_file, files_bytes_only;
+
+// Take the next file of the list until there are none left
+static void *file_worker(void *arg) {
+  for (;;) {
+    pthread_mutex_lock(&files_lock);
+    int i = next_file++;
+    pthread_mutex_unlock(&files_lock);
+    if (i >= num_files)
+      return NULL;
+
+    files[i].ret = count_path(files[i].name, files_bytes_only, 1, &files[i].c);
+
+    pthread_mutex_lock(&files_lock);
+    files[i].done = 1;
+    pthread_cond_broadcast(&files_done);
+    pthread_mutex_unlock(&files_lock);
+  }
+}
+
+// What to print, in this order
+#define PRINT_LINES 1
+#define PRINT_WORDS 2
+#define PRINT_CHARS 4
+#define PRINT_BYTES 8
+#define PRINT_MAX_LINE 16
+
+static void print_counts(const wc_counts *c, int print, const char *name) {
+  if (print & PRINT_LINES)
+    printf("%llu ", c->lines);
+  if (print & PRINT_WORDS)
+    printf("%llu ", c->words);
+  if (print & PRINT_CHARS)
+    printf("%llu ", c->chars);
+  if (print & PRINT_BYTES)
+    printf("%llu ", c->bytes);
+  if (print & PRINT_MAX_LINE)
+    printf("%llu ", c->max_line);
+  printf("%s\n", name);
+}
 
 /* wc program */
 /* Usage: wc [<] [infile] */
 int wc(int argc, char *argv[]) {
-  int print_lines = 1, print_words = 1, print_chars = 1;
-  int total_lines = 0, total_words = 0, total_chars = 0;
+  int print = 0;
+  int ret = 0;
+  wc_counts total = {0};
   int i;
-  FILE *file;
+
+  num_threads = sysconf(_SC_NPROCESSORS_ONLN);
 
   // Parse command-line arguments
   for (i = 1; i < argc; i++) {
-    if (argv[i][0] == '-') {
+    if (argv[i][0] == '-' && argv[i][1] != '\0') {
       if (strcmp(argv[i], "-h") == 0) {
         printf("Usage: wc [options] [file...]\n");
         printf("Options:\n");
         printf("  -l    Print the number of lines\n");
         printf("  -w    Print the number of words\n");
-        printf("  -c    Print the number of characters\n");
-        printf("  -m    Print the number of multibyte characters (not "
-               "implemented)\n");
+        printf("  -c    Print the number of bytes\n");
+        printf("  -m    Print the number of UTF-8 characters\n");
+        printf("  -L    Print the length of the longest line\n");
+        printf("  -j N  Count with N threads (default: number of CPUs)\n");
         printf("  -h    Display this help message\n");
         return 0;
       } else if (strcmp(argv[i], "-l") == 0) {
-        print_words = 0;
-        print_chars = 0;
+        print |= PRINT_LINES;
       } else if (strcmp(argv[i], "-w") == 0) {
-        print_lines = 0;
-        print_chars = 0;
+        print |= PRINT_WORDS;
       } else if (strcmp(argv[i], "-c") == 0) {
-        print_lines = 0;
-        print_words = 0;
+        print |= PRINT_BYTES;
       } else if (strcmp(argv[i], "-m") == 0) {
-        // Not implemented
+        print |= PRINT_CHARS;
+      } else if (strcmp(argv[i], "-L") == 0) {
+        print |= PRINT_MAX_LINE;
+      } else if (strncmp(argv[i], "-j", 2) == 0) {
+        const char *n = argv[i][2] ? argv[i] + 2 : i + 1 < argc ? argv[++i] : "";
+        num_threads = atoi(n);
+        if (num_threads < 1) {
+          fprintf(stderr, "Invalid number of threads: %s\n", n);
+          return 1;
+        }
       } else {
         fprintf(stderr, "Unknown option: %s\n", argv[i]);
         return 1;
       }
+    } else {
+      argv[1 + num_files++] = argv[i];
     }
   }
+  if (num_threads < 1)
+    num_threads = 1;
+  if (num_threads > MAX_THREADS)
+    num_threads = MAX_THREADS;
 
-  if (argc == 1 || (argc == 2 && argv[1][0] == '-' && argv[1][1] == '\0')) {
+  if (print == 0)
+    print = PRINT_LINES | PRINT_WORDS | PRINT_BYTES;
+  int bytes_only = print == PRINT_BYTES;
+  want_max_line = print & PRINT_MAX_LINE;
+
+  // Set up before any thread starts
+  count_block = select_kernel();
+
+  if (num_files == 0) {
     // No files specified, read from stdin
-    int nline = 0, nword = 0, nchar = 0;
-    int letter, inword = 0;
-
-    while ((letter = getc(stdin)) != EOF) {
-      ++nchar;
-      if (letter == '\n')
-        ++nline;
-      if (letter == ' ' || letter == '\n' || letter == '\t')
-        inword = 1;
-      else if (inword == 0) {
-        inword = 1;
-        ++nword;
-      }
-    }
-    if (print_lines)
-      printf("%d ", nline);
-    if (print_words)
-      printf("%d ", nword);
-    if (print_chars)
-      printf("%d ", nchar);
-    printf("\n");
-  } else {
-    // Files specified
-    int total_file_lines = 0, total_file_words = 0, total_file_chars = 0;
-
-    for (i = 1; i < argc; i++) {
-      if (argv[i][0] == '-')
-        continue; // Skip options
-
-      file = fopen(argv[i], "r");
-      if (file == NULL) {
-        perror(argv[i]);
-        continue;
-      }
+    wc_counts c = {0};
 
-      int nline = 0, nword = 0, nchar = 0;
-      int letter, inword = 0;
-      while ((letter = getc(file)) != EOF) {
-        ++nchar;
-        if (letter == '\n')
-          ++nline;
-        if (letter == ' ' || letter == '\n' || letter == '\t')
-          inword = 1;
-        else if (inword == 0) {
-          inword = 1;
-          ++nword;
-        }
-      }
-      fclose(file);
-
-      if (print_lines || print_words || print_chars) {
-        if (print_lines)
-          printf("%d ", nline);
-        if (print_words)
-          printf("%d ", nword);
-        if (print_chars)
-          printf("%d ", nchar);
-        printf("%s\n", argv[i]);
-      }
+    if (count_fd(STDIN_FILENO, "stdin", bytes_only, num_threads, &c) < 0)
+      ret = 1;
+    print_counts(&c, print, "");
+    return ret;
+  }
 
-      total_file_lines += nline;
-      total_file_words += nword;
-      total_file_chars += nchar;
-    }
+  // With several files each thread counts whole files, a single file is
+  // split between the threads instead
+  files = xzalloc(num_files * sizeof(wc_file));
+  for (i = 0; i < num_files; i++)
+    files[i].name = argv[1 + i];
+  files_bytes_only = bytes_only;
 
-    // Print total counts if there were multiple files
-    if (argc > 2) {
-      if (print_lines)
-        printf("%d ", total_file_lines);
-      if (print_words)
-        printf("%d ", total_file_words);
-      if (print_chars)
-        printf("%d ", total_file_chars);
-      printf("total\n");
+  int workers = num_files > 1 && !bytes_only ? num_threads : 0;
+  pthread_t tids[MAX_THREADS];
+  if (workers > num_files)
+    workers = num_files;
+  for (i = 0; i < workers; i++) {
+    if (pthread_create(&tids[i], NULL, file_worker, NULL) != 0)
+      break;
+  }
+  workers = i;
+
+  for (i = 0; i < num_files; i++) {
+    if (workers == 0) {
+      files[i].ret = count_path(files[i].name, bytes_only, num_threads,
+                                &files[i].c);
+    } else {
+      pthread_mutex_lock(&files_lock);
+      while (!files[i].done)
+        pthread_cond_wait(&files_done, &files_lock);
+      pthread_mutex_unlock(&files_lock);
     }
+
+    if (files[i].ret < 0)
+      ret = 1;
+    else
+      print_counts(&files[i].c, print, files[i].name);
+    total.lines += files[i].c.lines;
+    total.words += files[i].c.words;
+    total.chars += files[i].c.chars;
+    total.bytes += files[i].c.bytes;
+    if (files[i].c.max_line > total.max_line)
+      total.max_line = files[i].c.max_line;
   }
+  for (i = 0; i < workers; i++)
+    pthread_join(tids[i], NULL);
+  free(files);
 
-  return 0;
+  // Print total counts if there were multiple files
+  if (num_files > 1)
+    print_counts(&total, print, "total");
+
+  return ret;
 }